@@ -7,6 +7,7 @@
 #include <crt/defs.h>
 
 #include <stdlib.h>
+#include <errno.h>
 #include <assert.h>
 
 static void
@@ -162,6 +163,78 @@ out:
     return rc;
 }
 
+int
+evtloop_pollfds(struct evtloop *loop, struct pollfd *fds, int nfds)
+{
+    struct pollevt *evt;
+    int n = 0;
+
+    list_for_each_entry(&loop->pollevts, evt, entry) {
+        if (n < nfds) {
+            fds[n].fd = evt->fd;
+            fds[n].events = evt->events;
+            fds[n].revents = 0;
+        }
+        n++;
+    }
+
+    return n;
+}
+
+int
+evtloop_deadline(struct evtloop *loop, struct timeval *deadline)
+{
+    struct timer *timer;
+
+    timer = list_first_entry(&loop->timers->list, struct timer, entry);
+    if (!timer) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    *deadline = timer->timeo;
+    return 0;
+}
+
+void
+evtloop_dispatch(struct evtloop *loop,
+                 const struct pollfd *fds, int nfds,
+                 const struct timeval *now)
+{
+    struct pollevt *evt;
+    struct timeval _now;
+    int i;
+
+    for (i = 0; i < nfds; i++) {
+        if (!fds[i].revents)
+            continue;
+
+        list_for_each_entry(&loop->pollevts, evt, entry) {
+            int revents = fds[i].revents;
+
+            if (evt->fd != fds[i].fd)
+                continue;
+
+            /* as select has it, errors and hangups make the fd ready */
+            if (revents & (POLLERR|POLLHUP|POLLNVAL))
+                revents |= evt->events;
+
+            revents &= evt->events;
+
+            if (revents)
+                evt->fn(revents, evt->data);
+            break;
+        }
+    }
+
+    if (now)
+        _now = *now;
+    else
+        gettimeofday(&_now, NULL);
+
+    timerwheel_run(loop->timers, &_now);
+}
+
 void
 evtloop_destroy(struct evtloop *loop)
 {
@@ -27,6 +27,21 @@ void pollevt_select(struct pollevt *evt, short events);
 
 void pollevt_destroy(struct pollevt *evt);
 
+/*
+ * Driving a loop from someone else's, instead of iterating it:
+ * poll the fds from evtloop_pollfds, wake up by the deadline, and
+ * hand the results to evtloop_dispatch. evtloop_pollfds returns
+ * the number of fds in the loop, and fills in up to @nfds of
+ * them. evtloop_deadline fails if no timer is armed.
+ */
+int evtloop_pollfds(struct evtloop *loop, struct pollfd *fds, int nfds);
+
+int evtloop_deadline(struct evtloop *loop, struct timeval *deadline);
+
+void evtloop_dispatch(struct evtloop *loop,
+                      const struct pollfd *fds, int nfds,
+                      const struct timeval *now);
+
 #endif
 
 /*
@@ -0,0 +1,26 @@
+#ifndef CRT_HIST_INTERNAL_H
+#define CRT_HIST_INTERNAL_H
+
+#include <crt/hist.h>
+
+#define HIST_SUB_BITS     5
+#define HIST_SUB_BUCKETS  (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS      ((32 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+struct hist {
+    uint64_t cnt;
+    uint32_t max;
+    uint32_t bucket[HIST_BUCKETS];
+};
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,116 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <crt/hist-internal.h>
+#include <crt/defs.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+struct hist *
+hist_create(void)
+{
+    struct hist *hist;
+
+    hist = calloc(1, sizeof(*hist));
+    expected(hist);
+
+    return hist;
+}
+
+void
+hist_destroy(struct hist *hist)
+{
+    free(hist);
+}
+
+void
+hist_reset(struct hist *hist)
+{
+    memset(hist, 0, sizeof(*hist));
+}
+
+static int
+hist_index(uint32_t val)
+{
+    int shift;
+
+    if (val < 2 * HIST_SUB_BUCKETS)
+        return val;
+
+    shift = 31 - __builtin_clz(val) - HIST_SUB_BITS;
+
+    return (shift + 1) * HIST_SUB_BUCKETS
+        + (val >> shift) - HIST_SUB_BUCKETS;
+}
+
+/*
+ * Highest value mapping to bucket @idx.
+ */
+static uint32_t
+hist_value(int idx)
+{
+    uint32_t sub;
+    int shift;
+
+    if (idx < 2 * HIST_SUB_BUCKETS)
+        return idx;
+
+    shift = idx / HIST_SUB_BUCKETS - 1;
+    sub = idx % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS;
+
+    return (sub << shift) + ((1U << shift) - 1);
+}
+
+void
+hist_record(struct hist *hist, uint32_t val)
+{
+    hist->bucket[hist_index(val)]++;
+    hist->cnt++;
+    hist->max = max(hist->max, val);
+}
+
+uint64_t
+hist_count(const struct hist *hist)
+{
+    return hist->cnt;
+}
+
+uint32_t
+hist_max(const struct hist *hist)
+{
+    return hist->max;
+}
+
+uint32_t
+hist_percentile(const struct hist *hist, double pct)
+{
+    uint64_t rank, sum;
+    int i;
+
+    if (!hist->cnt)
+        return 0;
+
+    rank = pct / 100 * hist->cnt + 0.5;
+    rank = max(rank, 1);
+
+    sum = 0;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        sum += hist->bucket[i];
+        if (sum >= rank)
+            return min(hist_value(i), hist->max);
+    }
+
+    return hist->max;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
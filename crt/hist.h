@@ -0,0 +1,35 @@
+#ifndef CRT_HIST_H
+#define CRT_HIST_H
+
+#include <stdint.h>
+
+/*
+ * Log-linear histogram of unsigned 32-bit values, HDR style:
+ * each power of two is split into HIST_SUB_BUCKETS linear
+ * buckets, bounding relative error to 1/HIST_SUB_BUCKETS.
+ */
+struct hist * hist_create(void);
+
+void hist_destroy(struct hist *hist);
+
+void hist_record(struct hist *hist, uint32_t val);
+
+void hist_reset(struct hist *hist);
+
+uint64_t hist_count(const struct hist *hist);
+
+uint32_t hist_max(const struct hist *hist);
+
+uint32_t hist_percentile(const struct hist *hist, double pct);
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -2,17 +2,8 @@
 #define CRT_TIMER_INTERNAL_H
 
 #include <crt/timer.h>
-#include <crt/list.h>
 #include <sys/time.h>
 
-struct timer {
-    struct timeval timeo;
-    timer_fn fn;
-    void *data;
-    struct evtloop *loop;
-    struct list entry;
-};
-
 struct timerwheel {
     struct list list;
 };
@@ -16,11 +16,17 @@ __timer_create(timer_fn fn, void *data)
     if (!expected(timer))
         goto out;
 
+    timer_init(timer, fn, data);
+out:
+    return timer;
+}
+
+void
+timer_init(struct timer *timer, timer_fn fn, void *data)
+{
     timer->entry = LIST(&timer->entry);
     timer->fn = fn;
     timer->data = data;
-out:
-    return timer;
 }
 
 void
@@ -1,13 +1,28 @@
 #ifndef CRT_TIMER_H
 #define CRT_TIMER_H
 
+#include <crt/list.h>
 #include <sys/time.h>
 struct evtloop;
 
 typedef void (*timer_fn)(const struct timeval *timeo, void *data);
 
+struct timer {
+    struct timeval timeo;
+    timer_fn fn;
+    void *data;
+    struct evtloop *loop;
+    struct list entry;
+};
+
 struct timer *__timer_create(timer_fn fn, void *priv);
 
+/*
+ * For timers embedded in other objects. Destroy them with
+ * timer_stop, not timer_destroy.
+ */
+void timer_init(struct timer *timer, timer_fn fn, void *data);
+
 void timer_stop(struct timer *timer);
 
 void timer_destroy(struct timer *timer);
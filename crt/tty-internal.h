@@ -6,6 +6,8 @@
 
 struct tty {
     int fd;
+    speed_t speed;
+    int outq;
     struct pollevt *evt;
 
     const struct iovec *iov;
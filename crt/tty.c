@@ -14,6 +14,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <termios.h>
+#include <sys/ioctl.h>
 
 speed_t
 tty_speed(int arg)
@@ -34,10 +35,29 @@ tty_speed(int arg)
     return -1;
 }
 
+int
+tty_baud(struct tty *tty)
+{
+    switch (tty->speed) {
+    case B115200:
+        return 115200;
+    case B57600:
+        return 57600;
+    case B38400:
+        return 38400;
+    case B19200:
+        return 19200;
+    case B9600:
+        return 9600;
+    }
+
+    return -1;
+}
+
 struct tty *
 tty_open(const char *path, speed_t speed)
 {
-    int rc;
+    int rc, n;
     struct termios tio;
     struct tty *tty;
 
@@ -51,6 +71,8 @@ tty_open(const char *path, speed_t speed)
     if (tty->fd < 0)
         goto out;
 
+    tty->speed = speed;
+
     tio = (struct termios) {
         .c_iflag = 0,
         .c_cflag = CREAD|CLOCAL|CS8,
@@ -78,6 +100,9 @@ tty_open(const char *path, speed_t speed)
     rc = tcflush(tty->fd, TCOFLUSH);
     if (unexpected(rc))
         goto out;
+
+    /* not every driver can tell, ask once */
+    tty->outq = !ioctl(tty->fd, TIOCOUTQ, &n);
 out:
     if (rc) {
         tty_close(tty);
@@ -98,51 +123,53 @@ tty_close(struct tty *tty)
     free(tty);
 }
 
-int
+ssize_t
 tty_send(struct tty *tty, const void *buf, size_t len)
 {
-    int rc;
     ssize_t n;
 
-    rc = -1;
-
     n = write(tty->fd, buf, len);
     if (n < 0) {
+        if (errno == EAGAIN)
+            return 0;
+
         log_perror("write");
-        goto out;
     }
 
-    assert(n == len);
-    rc = 0;
-out:
-    return rc;
+    return n;
 }
 
-int
+ssize_t
 tty_sendv(struct tty *tty, struct iovec *iov, int cnt)
 {
-    int rc;
     ssize_t n;
 
-    rc = -1;
-
     n = writev(tty->fd, iov, cnt);
     if (n < 0) {
+        if (errno == EAGAIN)
+            return 0;
+
         log_perror("writev");
-        goto out;
     }
 
-    while (n && cnt) {
-        assert(iov->iov_len <= n);
-        n -= iov->iov_len;
-        iov++;
-        cnt--;
+    return n;
+}
+
+int
+tty_outq(struct tty *tty)
+{
+    int rc, n;
+
+    if (!tty->outq) {
+        errno = ENOTSUP;
+        return -1;
     }
 
-    assert(n == 0);
-    rc = 0;
-out:
-    return rc;
+    rc = ioctl(tty->fd, TIOCOUTQ, &n);
+    if (unexpected(rc))
+        return -1;
+
+    return n;
 }
 
 void
@@ -9,11 +9,24 @@ speed_t tty_speed(int baud);
 
 struct tty * tty_open(const char *path, speed_t);
 
+int tty_baud(struct tty *tty);
+
 void tty_close(struct tty *);
 
-int tty_send(struct tty *tty, const void *buf, size_t len);
+/*
+ * Write as much as the driver takes without blocking. Returns
+ * the number of bytes written, which may fall short of @len, or
+ * be 0 while the driver is full.
+ */
+ssize_t tty_send(struct tty *tty, const void *buf, size_t len);
+
+ssize_t tty_sendv(struct tty *tty, struct iovec *iov, int cnt);
 
-int tty_sendv(struct tty *tty, struct iovec *iov, int cnt);
+/*
+ * Bytes written but not yet sent by the driver. Fails with
+ * ENOTSUP, quietly, where the driver can't tell.
+ */
+int tty_outq(struct tty *tty);
 
 typedef void (*tty_rx_fn)(struct tty *tty, int err, void *priv);
 
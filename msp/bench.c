@@ -0,0 +1,331 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <msp/scan.h>
+
+#include <crt/defs.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <time.h>
+
+#define MSP_BENCH_COLS   (sizeof(struct msp_raw_imu) / sizeof(int16_t))
+#define MSP_BENCH_BATCH  4096
+
+struct msp_bench_result {
+    struct msp_scan scan;
+    unsigned long rows;
+    uint32_t colsum;
+    double scan_secs;
+    double decode_secs;
+};
+
+static uint32_t msp_bench_seed = 1;
+
+static uint32_t
+msp_bench_rand(void)
+{
+    uint32_t x = msp_bench_seed;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    return msp_bench_seed = x;
+}
+
+static size_t
+msp_bench_frame(uint8_t *buf, char dsc, uint8_t cmd, size_t len)
+{
+    uint8_t *pos = buf;
+    uint8_t cks;
+    int i;
+
+    *pos++ = '$';
+    *pos++ = 'M';
+    *pos++ = dsc;
+    *pos++ = len;
+    *pos++ = cmd;
+
+    cks = len ^ cmd;
+    for (i = 0; i < len; i++) {
+        *pos = msp_bench_rand();
+        cks ^= *pos++;
+    }
+
+    *pos++ = cks;
+
+    return pos - buf;
+}
+
+/*
+ * What a sniffer would see: mostly MSP_RAW_IMU polls and their
+ * responses, some other telemetry, line noise, and now and then
+ * a corrupt frame.
+ */
+static size_t
+msp_bench_capture(uint8_t *buf, size_t size, size_t noise)
+{
+    size_t off = 0;
+    unsigned long n = 0;
+
+    while (off + max(MSP_HDR_MIN + MSP_V0_LEN_MAX + 1, noise) < size) {
+        unsigned int r = msp_bench_rand() % 100;
+        size_t len;
+
+        if (r < 60)
+            len = msp_bench_frame(buf + off, '>', MSP_RAW_IMU,
+                                  sizeof(struct msp_raw_imu));
+        else if (r < 70)
+            len = msp_bench_frame(buf + off, '<', MSP_RAW_IMU, 0);
+        else if (r < 85)
+            len = msp_bench_frame(buf + off, '>', MSP_ATTITUDE,
+                                  sizeof(struct msp_attitude));
+        else if (r < 95)
+            len = msp_bench_frame(buf + off, '>', MSP_STATUS,
+                                  sizeof(struct msp_status));
+        else {
+            len = 1 + msp_bench_rand() % noise;
+            for (r = 0; r < len; r++)
+                buf[off + r] = msp_bench_rand();
+        }
+
+        if (++n % 1000 == 0)
+            buf[off + len / 2] ^= 0x10;
+
+        off += len;
+    }
+
+    return off;
+}
+
+static double
+msp_bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+msp_bench_run(const uint8_t *buf, size_t size, int scalar, int rounds,
+              struct msp_bench_result *res)
+{
+    static struct msp_scan_frame frames[MSP_BENCH_BATCH];
+    static int16_t store[MSP_BENCH_COLS][MSP_BENCH_BATCH];
+    int16_t *cols[MSP_BENCH_COLS];
+    double t;
+    int i, r;
+
+    for (i = 0; i < MSP_BENCH_COLS; i++)
+        cols[i] = store[i];
+
+    memset(res, 0, sizeof(*res));
+
+    t = msp_bench_now();
+    for (r = 0; r < rounds; r++) {
+        struct msp_scan scan = { .scalar = scalar };
+        size_t pos = 0;
+
+        while (msp_scan(&scan, buf, size, &pos,
+                        frames, array_size(frames)) > 0)
+            ;
+
+        res->scan = scan;
+    }
+    res->scan_secs = msp_bench_now() - t;
+
+    t = msp_bench_now();
+    for (r = 0; r < rounds; r++) {
+        struct msp_scan scan = { .scalar = scalar };
+        size_t pos = 0;
+        int cnt;
+
+        res->rows = 0;
+        res->colsum = 0;
+
+        while ((cnt = msp_scan(&scan, buf, size, &pos,
+                               frames, array_size(frames))) > 0) {
+            int rows, j;
+
+            rows = msp_scan_columns(frames, cnt, MSP_RAW_IMU,
+                                    cols, MSP_BENCH_COLS);
+            if (rows < 0) {
+                perror("msp_scan_columns");
+                return -1;
+            }
+
+            for (i = 0; i < MSP_BENCH_COLS; i++)
+                for (j = 0; j < rows; j++)
+                    res->colsum += (uint16_t)cols[i][j] * (i + 1);
+
+            res->rows += rows;
+        }
+    }
+    res->decode_secs = msp_bench_now() - t;
+
+    return 0;
+}
+
+static void
+msp_bench_print(const char *mode, size_t size, int rounds,
+                const struct msp_bench_result *res)
+{
+    double bytes = (double)size * rounds;
+
+    printf("%s.scan: %.2f GB/s\n", mode, bytes / res->scan_secs / 1e9);
+    printf("%s.decode: %.2f GB/s\n", mode, bytes / res->decode_secs / 1e9);
+}
+
+static void
+msp_usage(FILE *s, const char *prog)
+{
+    fprintf(s,
+            "Usage:\n"
+            "  %s [ -m <MB> ] [ -j <bytes> ] [ -r <rounds> ] [ -h ]"
+            " [ capture ]\n"
+            "\n"
+            "Scan a capture, or a generated one of <MB>, for frames and\n"
+            "decode the MSP_RAW_IMU responses in it to columns, with\n"
+            "and without SIMD.\n"
+            "\n"
+            "Options:\n"
+            "  -m <MB> -- size of the generated capture, default 64\n"
+            "  -j <bytes> -- line noise runs of up to <bytes>, default 8\n"
+            "  -r <rounds> -- passes over the capture, default 4\n"
+            "\n", prog);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct msp_bench_result simd, scalar;
+    size_t size, noise;
+    uint8_t *buf;
+    int rc, rounds;
+
+    rc = -1;
+    buf = NULL;
+    size = 64;
+    noise = 8;
+    rounds = 4;
+
+    do {
+        int c;
+
+        c = getopt(argc, argv, "m:j:r:h");
+        if (c < 0)
+            break;
+
+        switch (c) {
+        case 'm':
+            size = atoi(optarg);
+            break;
+
+        case 'j':
+            noise = atoi(optarg);
+            break;
+
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+
+        case 'h':
+            rc = 0;
+        default:
+            goto usage;
+        }
+    } while (1);
+
+    if (!size || !noise || rounds <= 0)
+        goto usage;
+
+    if (optind < argc) {
+        FILE *f;
+        long len;
+
+        f = fopen(argv[optind], "r");
+        if (!f) {
+            perror(argv[optind]);
+            goto out;
+        }
+
+        if (fseek(f, 0, SEEK_END) ||
+            (len = ftell(f)) < 0 ||
+            fseek(f, 0, SEEK_SET)) {
+            perror(argv[optind]);
+            fclose(f);
+            goto out;
+        }
+
+        size = len;
+        buf = malloc(max(size, 1));
+        if (!buf || (size && fread(buf, size, 1, f) != 1)) {
+            perror(argv[optind]);
+            fclose(f);
+            goto out;
+        }
+
+        fclose(f);
+    } else {
+        size <<= 20;
+        buf = malloc(size);
+        if (!buf) {
+            perror("malloc");
+            goto out;
+        }
+
+        size = msp_bench_capture(buf, size, noise);
+    }
+
+    rc = msp_bench_run(buf, size, 0, rounds, &simd);
+    if (rc)
+        goto out;
+
+    rc = msp_bench_run(buf, size, 1, rounds, &scalar);
+    if (rc)
+        goto out;
+
+    printf("bytes: %zu\n", size);
+    printf("frames: %lu\n", simd.scan.frames);
+    printf("bad: %lu\n", simd.scan.bad);
+    printf("junk: %lu\n", simd.scan.junk);
+    printf("rows: %lu\n", simd.rows);
+
+    msp_bench_print("simd", size, rounds, &simd);
+    msp_bench_print("scalar", size, rounds, &scalar);
+
+    if (simd.scan.frames != scalar.scan.frames ||
+        simd.scan.bad != scalar.scan.bad ||
+        simd.scan.junk != scalar.scan.junk ||
+        simd.rows != scalar.rows ||
+        simd.colsum != scalar.colsum) {
+        fprintf(stderr, "simd and scalar results differ\n");
+        rc = -1;
+    }
+out:
+    if (buf)
+        free(buf);
+
+    return rc ? 1 : 0;
+
+usage:
+    msp_usage(rc ? stderr : stdout, basename(argv[0]));
+    goto out;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
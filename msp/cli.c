@@ -3,6 +3,7 @@
 #endif
 
 #include <msp/msp.h>
+#include <msp/profile.h>
 #include <msp/str.h>
 #include <msp/cmd.h>
 #include <msp/defs.h>
@@ -437,6 +438,42 @@ out:
     return rc;
 }
 
+static int
+msp_cli_stats(struct msp *msp)
+{
+    msp_cmd_t cmd;
+
+    for (cmd = msp_stat_next(msp, 0); cmd; cmd = msp_stat_next(msp, cmd)) {
+        struct msp_stat st;
+        const char *name;
+        int rc;
+
+        rc = msp_stat(msp, cmd, &st);
+        if (rc) {
+            perror("msp_stat");
+            return rc;
+        }
+
+        if (!st.cnt && !st.timeouts)
+            continue;
+
+        name = msp_cmd_name(cmd) ? : "?";
+
+        printf("stats.%s.cnt: %lu\n", name, st.cnt);
+        printf("stats.%s.timeouts: %lu\n", name, st.timeouts);
+        printf("stats.%s.retries: %lu\n", name, st.retries);
+        printf("stats.%s.wire: %lu us\n", name, st.wire);
+        printf("stats.%s.srtt: %lu us\n", name, st.srtt);
+        printf("stats.%s.rto: %lu us\n", name, st.rto);
+        printf("stats.%s.p50: %lu us\n", name, st.p50);
+        printf("stats.%s.p99: %lu us\n", name, st.p99);
+        printf("stats.%s.p999: %lu us\n", name, st.p999);
+        printf("stats.%s.max: %lu us\n", name, st.max);
+    }
+
+    return 0;
+}
+
 static int
 msp_cli_box(struct msp *msp)
 {
@@ -659,8 +696,12 @@ msp_usage(FILE *s, const char *prog)
 {
     fprintf(s,
             "Usage:\n"
-            "  %s [ -T <tty> ] [ -b <baud> ] [ -V ] [ -h ]"
+            "  %s [ -T <tty> ] [ -b <baud> ] [ -C <cache> ] [ -N ] [ -V ] [ -h ]"
             " command [ args .. ] -- ...\n"
+            "\n"
+            "Options:\n"
+            "  -C <cache> -- keep device metadata in <cache> across runs\n"
+            "  -N -- negotiate framing and payload size with the controller\n"
             "\n", prog);
     fprintf(s,
             "Commands:\n"
@@ -680,6 +721,7 @@ msp_usage(FILE *s, const char *prog)
             "  servo -- read servo control\n"
             "  set-box -- set box items\n"
             "  set-raw-rc -- set RC channels\n"
+            "  stats -- show round trip times of commands run so far\n"
             "  status -- read controller status\n"
             "\n");
 }
@@ -687,17 +729,21 @@ msp_usage(FILE *s, const char *prog)
 int
 main(int argc, char **argv)
 {
-    const char *ttypath;
+    const char *ttypath, *cachepath;
+    struct msp_profile *prof;
     struct msp *msp;
     struct tty *tty;
     struct evtloop *loop;
     speed_t speed;
-    int rc, fd;
+    int rc, fd, nego;
 
     fd = -1;
+    nego = 0;
     rc = -1;
     ttypath = "/dev/ttyUSB0";
+    cachepath = NULL;
     speed = B115200;
+    prof = NULL;
     msp = NULL;
     tty = NULL;
     loop = NULL;
@@ -705,7 +751,7 @@ main(int argc, char **argv)
     do {
         int c;
 
-        c = getopt(argc, argv, "+T:b:Vh");
+        c = getopt(argc, argv, "+T:b:C:NVh");
         if (c < 0)
             break;
 
@@ -720,6 +766,14 @@ main(int argc, char **argv)
                 goto usage;
             break;
 
+        case 'C':
+            cachepath = optarg;
+            break;
+
+        case 'N':
+            nego = 1;
+            break;
+
         case 'V':
             printf("MultiWii Serial Protocol v%s, "
                    "MSPv%d\n", PACKAGE_VERSION, MSP_VERSION);
@@ -758,6 +812,20 @@ main(int argc, char **argv)
     if (!msp)
         goto out;
 
+    if (nego) {
+        rc = msp_negotiate(msp, NULL);
+        if (rc) {
+            perror("msp_negotiate");
+            goto out;
+        }
+    }
+
+    if (cachepath) {
+        prof = msp_profile_open(msp, cachepath, ttypath);
+        if (!prof)
+            perror(cachepath);
+    }
+
     for (; optind < argc; optind++) {
         const char *cmd;
 
@@ -841,6 +909,10 @@ main(int argc, char **argv)
                 rc = msp_cli_set_raw_rc(msp, argc, argv);
                 break;
             }
+            if (!strcmp(cmd, "stats")) {
+                rc = msp_cli_stats(msp);
+                break;
+            }
             if (!strcmp(cmd, "status")) {
                 rc = msp_cli_status(msp);
                 break;
@@ -860,6 +932,12 @@ main(int argc, char **argv)
     }
 
 out:
+    if (prof) {
+        if (msp_profile_save(prof))
+            perror(cachepath);
+        msp_profile_close(prof);
+    }
+
     if (msp)
         msp_close(msp);
 
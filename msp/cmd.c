@@ -12,12 +12,21 @@
 #include <errno.h>
 #include <assert.h>
 
+/*
+ * Per-call state lives on the caller's stack, the response is
+ * copied straight into the caller's buffer.
+ */
 struct msp_cmd_sync {
+    int done;
     int err;
-    void *data;
+    void *buf;
+    size_t size;
     size_t len;
 };
 
+#define MSP_CMD_SYNC(_buf, _size)                       \
+    (struct msp_cmd_sync) { .buf = (_buf), .size = (_size) }
+
 static void
 msp_sync_retfn(int err,
                const struct msp_hdr *hdr,
@@ -27,57 +36,53 @@ msp_sync_retfn(int err,
 
     assert(err != EAGAIN);
     sync->err = err;
+    sync->done = 1;
 
-    if (!sync->err) {
+    if (!sync->err)
         sync->len = hdr->len;
-        sync->data = data;
+
+    /* didn't fit, or came from elsewhere */
+    if (data && data != sync->buf) {
+        if (sync->buf)
+            memcpy(sync->buf, data, min(sync->len, sync->size));
+        free(data);
     }
 }
 
 static int
 msp_req_send(struct msp *msp,
-             msp_cmd_t cmd, void *args, size_t len)
+             msp_cmd_t cmd, const void *args, size_t len,
+             struct msp_cmd_sync *sync)
 {
-    struct msp_cmd_sync *sync;
-    int rc;
-
-    sync = calloc(1, sizeof(*sync));
-
-    rc = expected(sync) ? 0 : -1;
-    if (rc)
-        goto out;
-
-    rc = msp_call(msp, cmd, args, len,
-                  msp_sync_retfn, sync,
-                  &MSP_CMD_TIMEOUT);
-
-out:
-    if (rc && sync)
-        free(sync);
-
-    return rc;
+    struct msp_req req = {
+        .cmd = cmd,
+        .args = args,
+        .len = len,
+        .rfn = msp_sync_retfn,
+        .priv = sync,
+        .rsp = sync->buf,
+        .rsplen = sync->size,
+    };
+
+    return msp_call_batch(msp, &req, 1, NULL);
 }
 
 static int
-__msp_rsp_recv(struct msp *msp,
-               msp_cmd_t cmd, void *data, size_t *_len)
+__msp_rsp_recv(struct msp *msp, msp_cmd_t cmd,
+               struct msp_cmd_sync *sync, size_t *_len)
 {
-    struct msp_call *call;
-    struct msp_cmd_sync *sync;
     int rc;
 
-    sync = NULL;
-    call = msp_call_get(msp, cmd);
-
-    rc = expected(call) ? 0 : -1;
-    if (rc)
-        goto out;
-
-    sync = call->priv;
-
-    msp_sync(msp, cmd);
+    /* wait for our call alone, not for others queued on @cmd */
+    while (!sync->done) {
+        rc = evtloop_iterate(msp->loop);
+        if (rc && errno != ETIMEDOUT)
+            break;
+    }
 
-    call = NULL;
+    /* the loop failed, @sync must not outlive us */
+    if (!sync->done)
+        msp_call_cancel(msp, cmd, sync);
 
     rc = sync->err ? -1 : 0;
     if (rc) {
@@ -85,40 +90,27 @@ __msp_rsp_recv(struct msp *msp,
         goto out;
     }
 
-    if (data && sync->data) {
-        size_t len = min(*_len, sync->len);
-
-        memcpy(data, sync->data, len);
-
-        *_len = len;
-    }
-
+    if (_len)
+        *_len = min(*_len, sync->len);
 out:
-    if (sync) {
-        if (sync->data)
-            free(sync->data);
-
-        free(sync);
-    }
-
     return rc;
 }
 
 static int
-msp_rsp_recv(struct msp *msp,
-             msp_cmd_t cmd, void *data, size_t len)
+msp_rsp_recv(struct msp *msp, msp_cmd_t cmd, struct msp_cmd_sync *sync)
 {
-    size_t _len;
+    size_t len;
     int rc;
 
-    _len = len;
+    len = sync->size;
 
-    rc = __msp_rsp_recv(msp, cmd, data, &_len);
+    rc = __msp_rsp_recv(msp, cmd, sync, &len);
     if (rc)
         goto out;
 
-    if (_len != len) {
+    if (len != sync->size) {
         errno = EPROTO;
+        rc = -1;
         goto out;
     }
 
@@ -129,13 +121,14 @@ out:
 int
 msp_ident(struct msp *msp, struct msp_ident *ident, size_t *_len)
 {
+    struct msp_cmd_sync sync = MSP_CMD_SYNC(ident, *_len);
     int rc;
 
-    rc = msp_req_send(msp, MSP_IDENT, NULL, 0);
+    rc = msp_req_send(msp, MSP_IDENT, NULL, 0, &sync);
     if (rc)
         goto out;
 
-    rc = __msp_rsp_recv(msp, MSP_IDENT, ident, _len);
+    rc = __msp_rsp_recv(msp, MSP_IDENT, &sync, _len);
 out:
     return rc;
 }
@@ -143,13 +136,14 @@ out:
 int
 msp_raw_imu(struct msp *msp, struct msp_raw_imu *imu)
 {
+    struct msp_cmd_sync sync = MSP_CMD_SYNC(imu, sizeof(*imu));
     int rc;
 
-    rc = msp_req_send(msp, MSP_RAW_IMU, NULL, 0);
+    rc = msp_req_send(msp, MSP_RAW_IMU, NULL, 0, &sync);
     if (rc)
         goto out;
 
-    rc = msp_rsp_recv(msp, MSP_RAW_IMU, imu, sizeof(*imu));
+    rc = msp_rsp_recv(msp, MSP_RAW_IMU, &sync);
 out:
     return rc;
 }
@@ -157,13 +151,14 @@ out:
 int
 msp_altitude(struct msp *msp, struct msp_altitude *alt, size_t *_len)
 {
+    struct msp_cmd_sync sync = MSP_CMD_SYNC(alt, *_len);
     int rc;
 
-    rc = msp_req_send(msp, MSP_ALTITUDE, NULL, 0);
+    rc = msp_req_send(msp, MSP_ALTITUDE, NULL, 0, &sync);
     if (rc)
         goto out;
 
-    rc = __msp_rsp_recv(msp, MSP_ALTITUDE, alt, _len);
+    rc = __msp_rsp_recv(msp, MSP_ALTITUDE, &sync, _len);
 out:
     return rc;
 }
@@ -171,13 +166,14 @@ out:
 int
 msp_attitude(struct msp *msp, struct msp_attitude *att, size_t *_len)
 {
+    struct msp_cmd_sync sync = MSP_CMD_SYNC(att, *_len);
     int rc;
 
-    rc = msp_req_send(msp, MSP_ATTITUDE, NULL, 0);
+    rc = msp_req_send(msp, MSP_ATTITUDE, NULL, 0, &sync);
     if (rc)
         goto out;
 
-    rc = __msp_rsp_recv(msp, MSP_ATTITUDE, att, _len);
+    rc = __msp_rsp_recv(msp, MSP_ATTITUDE, &sync, _len);
 out:
     return rc;
 }
@@ -185,13 +181,14 @@ out:
 int
 msp_mag_calibration(struct msp *msp)
 {
+    struct msp_cmd_sync sync = MSP_CMD_SYNC(NULL, 0);
     int rc;
 
-    rc = msp_req_send(msp, MSP_MAG_CALIBRATION, NULL, 0);
+    rc = msp_req_send(msp, MSP_MAG_CALIBRATION, NULL, 0, &sync);
     if (rc)
         goto out;
 
-    rc = msp_rsp_recv(msp, MSP_MAG_CALIBRATION, NULL, 0);
+    rc = msp_rsp_recv(msp, MSP_MAG_CALIBRATION, &sync);
 out:
     return rc;
 }
@@ -199,13 +196,14 @@ out:
 int
 msp_acc_calibration(struct msp *msp)
 {
+    struct msp_cmd_sync sync = MSP_CMD_SYNC(NULL, 0);
     int rc;
 
-    rc = msp_req_send(msp, MSP_ACC_CALIBRATION, NULL, 0);
+    rc = msp_req_send(msp, MSP_ACC_CALIBRATION, NULL, 0, &sync);
     if (rc)
         goto out;
 
-    rc = msp_rsp_recv(msp, MSP_ACC_CALIBRATION, NULL, 0);
+    rc = msp_rsp_recv(msp, MSP_ACC_CALIBRATION, &sync);
 out:
     return rc;
 }
@@ -213,13 +211,14 @@ out:
 int
 msp_eeprom_write(struct msp *msp)
 {
+    struct msp_cmd_sync sync = MSP_CMD_SYNC(NULL, 0);
     int rc;
 
-    rc = msp_req_send(msp, MSP_EEPROM_WRITE, NULL, 0);
+    rc = msp_req_send(msp, MSP_EEPROM_WRITE, NULL, 0, &sync);
     if (rc)
         goto out;
 
-    rc = msp_rsp_recv(msp, MSP_EEPROM_WRITE, NULL, 0);
+    rc = msp_rsp_recv(msp, MSP_EEPROM_WRITE, &sync);
 out:
     return rc;
 }
@@ -227,13 +226,14 @@ out:
 int
 msp_reset_conf(struct msp *msp)
 {
+    struct msp_cmd_sync sync = MSP_CMD_SYNC(NULL, 0);
     int rc;
 
-    rc = msp_req_send(msp, MSP_RESET_CONF, NULL, 0);
+    rc = msp_req_send(msp, MSP_RESET_CONF, NULL, 0, &sync);
     if (rc)
         goto out;
 
-    rc = msp_rsp_recv(msp, MSP_RESET_CONF, NULL, 0);
+    rc = msp_rsp_recv(msp, MSP_RESET_CONF, &sync);
 out:
     return rc;
 }
@@ -241,13 +241,14 @@ out:
 int
 msp_status(struct msp *msp, struct msp_status *st, size_t *_len)
 {
+    struct msp_cmd_sync sync = MSP_CMD_SYNC(st, *_len);
     int rc;
 
-    rc = msp_req_send(msp, MSP_STATUS, NULL, 0);
+    rc = msp_req_send(msp, MSP_STATUS, NULL, 0, &sync);
     if (rc)
         goto out;
 
-    rc = __msp_rsp_recv(msp, MSP_STATUS, st, _len);
+    rc = __msp_rsp_recv(msp, MSP_STATUS, &sync, _len);
 out:
     return rc;
 }
@@ -255,13 +256,14 @@ out:
 int
 msp_servo(struct msp *msp, struct msp_servo *servo, size_t *_len)
 {
+    struct msp_cmd_sync sync = MSP_CMD_SYNC(servo, *_len);
     int rc;
 
-    rc = msp_req_send(msp, MSP_SERVO, NULL, 0);
+    rc = msp_req_send(msp, MSP_SERVO, NULL, 0, &sync);
     if (rc)
         goto out;
 
-    rc = __msp_rsp_recv(msp, MSP_SERVO, servo, _len);
+    rc = __msp_rsp_recv(msp, MSP_SERVO, &sync, _len);
 out:
     return rc;
 }
@@ -269,13 +271,14 @@ out:
 int
 msp_motor(struct msp *msp, struct msp_motor *motor, size_t *_len)
 {
+    struct msp_cmd_sync sync = MSP_CMD_SYNC(motor, *_len);
     int rc;
 
-    rc = msp_req_send(msp, MSP_MOTOR, NULL, 0);
+    rc = msp_req_send(msp, MSP_MOTOR, NULL, 0, &sync);
     if (rc)
         goto out;
 
-    rc = __msp_rsp_recv(msp, MSP_MOTOR, motor, _len);
+    rc = __msp_rsp_recv(msp, MSP_MOTOR, &sync, _len);
 out:
     return rc;
 }
@@ -283,13 +286,14 @@ out:
 int
 msp_motor_pins(struct msp *msp, struct msp_motor_pins *pins, size_t *_len)
 {
+    struct msp_cmd_sync sync = MSP_CMD_SYNC(pins, *_len);
     int rc;
 
-    rc = msp_req_send(msp, MSP_MOTOR_PINS, NULL, 0);
+    rc = msp_req_send(msp, MSP_MOTOR_PINS, NULL, 0, &sync);
     if (rc)
         goto out;
 
-    rc = __msp_rsp_recv(msp, MSP_MOTOR_PINS, pins, _len);
+    rc = __msp_rsp_recv(msp, MSP_MOTOR_PINS, &sync, _len);
 out:
     return rc;
 }
@@ -297,27 +301,29 @@ out:
 int
 msp_rc(struct msp *msp, struct msp_raw_rc *rrc, size_t *_len)
 {
+    struct msp_cmd_sync sync = MSP_CMD_SYNC(rrc, *_len);
     int rc;
 
-    rc = msp_req_send(msp, MSP_RC, NULL, 0);
+    rc = msp_req_send(msp, MSP_RC, NULL, 0, &sync);
     if (rc)
         goto out;
 
-    rc = __msp_rsp_recv(msp, MSP_RC, rrc, _len);
+    rc = __msp_rsp_recv(msp, MSP_RC, &sync, _len);
 out:
     return rc;
 }
 
 int
-msp_set_raw_rc(struct msp *msp, struct msp_raw_rc *rrc)
+msp_set_raw_rc(struct msp *msp, const struct msp_raw_rc *rrc)
 {
+    struct msp_cmd_sync sync = MSP_CMD_SYNC(NULL, 0);
     int rc;
 
-    rc = msp_req_send(msp, MSP_SET_RAW_RC, rrc, sizeof(*rrc));
+    rc = msp_req_send(msp, MSP_SET_RAW_RC, rrc, sizeof(*rrc), &sync);
     if (rc)
         goto out;
 
-    rc = msp_rsp_recv(msp, MSP_SET_RAW_RC, NULL, 0);
+    rc = msp_rsp_recv(msp, MSP_SET_RAW_RC, &sync);
 out:
     return rc;
 }
@@ -325,13 +331,14 @@ out:
 int
 msp_analog(struct msp *msp, struct msp_analog *analog, size_t *len)
 {
+    struct msp_cmd_sync sync = MSP_CMD_SYNC(analog, *len);
     int rc;
 
-    rc = msp_req_send(msp, MSP_ANALOG, NULL, 0);
+    rc = msp_req_send(msp, MSP_ANALOG, NULL, 0, &sync);
     if (rc)
         goto out;
 
-    rc = __msp_rsp_recv(msp, MSP_ANALOG, analog, len);
+    rc = __msp_rsp_recv(msp, MSP_ANALOG, &sync, len);
 out:
     return rc;
 }
@@ -339,16 +346,18 @@ out:
 int
 msp_box(struct msp *msp, uint16_t *box, int *_cnt)
 {
+    struct msp_cmd_sync sync;
     int rc;
     size_t len;
 
-    rc = msp_req_send(msp, MSP_BOX, NULL, 0);
+    len = *_cnt * sizeof(*box);
+    sync = MSP_CMD_SYNC(box, len);
+
+    rc = msp_req_send(msp, MSP_BOX, NULL, 0, &sync);
     if (rc)
         goto out;
 
-    len = *_cnt * sizeof(*box);
-
-    rc = __msp_rsp_recv(msp, MSP_BOX, box, &len);
+    rc = __msp_rsp_recv(msp, MSP_BOX, &sync, &len);
     if (rc)
         goto out;
 
@@ -360,13 +369,14 @@ out:
 int
 msp_boxnames(struct msp *msp, char *names, size_t *_len)
 {
+    struct msp_cmd_sync sync = MSP_CMD_SYNC(names, *_len);
     int rc;
 
-    rc = msp_req_send(msp, MSP_BOXNAMES, NULL, 0);
+    rc = msp_req_send(msp, MSP_BOXNAMES, NULL, 0, &sync);
     if (rc)
         goto out;
 
-    rc = __msp_rsp_recv(msp, MSP_BOXNAMES, names, _len);
+    rc = __msp_rsp_recv(msp, MSP_BOXNAMES, &sync, _len);
 out:
     return rc;
 }
@@ -374,27 +384,193 @@ out:
 int
 msp_boxids(struct msp *msp, uint8_t *boxids, size_t *_len)
 {
+    struct msp_cmd_sync sync = MSP_CMD_SYNC(boxids, *_len);
     int rc;
 
-    rc = msp_req_send(msp, MSP_BOXIDS, NULL, 0);
+    rc = msp_req_send(msp, MSP_BOXIDS, NULL, 0, &sync);
     if (rc)
         goto out;
 
-    rc = __msp_rsp_recv(msp, MSP_BOXIDS, boxids, _len);
+    rc = __msp_rsp_recv(msp, MSP_BOXIDS, &sync, _len);
 out:
     return rc;
 }
 
 int
-msp_set_box(struct msp *msp, uint16_t *items, int cnt)
+msp_set_box(struct msp *msp, const uint16_t *items, int cnt)
 {
+    struct msp_cmd_sync sync = MSP_CMD_SYNC(NULL, 0);
     int rc;
 
-    rc = msp_req_send(msp, MSP_SET_BOX, items, cnt * sizeof(*items));
+    rc = msp_req_send(msp, MSP_SET_BOX, items, cnt * sizeof(*items), &sync);
     if (rc)
         goto out;
 
-    rc = msp_rsp_recv(msp, MSP_SET_BOX, NULL, 0);
+    rc = msp_rsp_recv(msp, MSP_SET_BOX, &sync);
 out:
     return rc;
 }
+
+struct msp_cmd_async {
+    void (*fn)(void);
+    void *priv;
+};
+
+static int
+msp_req_send_async(struct msp *msp,
+                   msp_cmd_t cmd, const void *args, size_t len,
+                   msp_call_retfn rfn, void (*fn)(void), void *priv)
+{
+    struct msp_cmd_async *async;
+    struct msp_call *call;
+    struct msp_req req = {
+        .cmd = cmd,
+        .args = args,
+        .len = len,
+        .rfn = rfn,
+        .key = priv,
+        .release = free,
+    };
+    int rc;
+
+    async = malloc(sizeof(*async));
+
+    rc = expected(async) ? 0 : -1;
+    if (rc)
+        goto out;
+
+    async->fn = fn;
+    async->priv = priv;
+
+    /* cancelled by the caller's priv, freed if dropped */
+    req.priv = async;
+
+    rc = msp_call_submit(msp, &req, NULL, &call);
+out:
+    if (rc && async)
+        free(async);
+
+    return rc;
+}
+
+static void
+msp_done_retfn(int err,
+               const struct msp_hdr *hdr, void *data, void *priv)
+{
+    struct msp_cmd_async *async = priv;
+    msp_done_fn fn = (msp_done_fn)async->fn;
+
+    if (data)
+        free(data);
+
+    fn(err, async->priv);
+
+    free(async);
+}
+
+/*
+ * Fixed size responses are copied out, so a short one reads as
+ * zeroes past its end.
+ */
+#define MSP_CMD_ASYNC(_name, _cmd, _type)                               \
+static void                                                             \
+msp_##_name##_retfn(int err,                                            \
+                    const struct msp_hdr *hdr, void *data, void *priv)  \
+{                                                                       \
+    struct msp_cmd_async *async = priv;                                 \
+    msp_##_name##_fn fn = (msp_##_name##_fn)async->fn;                  \
+    _type rsp;                                                          \
+    size_t len;                                                         \
+                                                                        \
+    memset(&rsp, 0, sizeof(rsp));                                       \
+                                                                        \
+    len = err ? 0 : hdr->len;                                           \
+    if (data)                                                           \
+        memcpy(&rsp, data, min(len, sizeof(rsp)));                      \
+                                                                        \
+    fn(err, err ? NULL : &rsp, len, async->priv);                       \
+                                                                        \
+    if (data)                                                           \
+        free(data);                                                     \
+    free(async);                                                        \
+}                                                                       \
+                                                                        \
+int                                                                     \
+msp_##_name##_async(struct msp *msp, msp_##_name##_fn fn, void *priv)   \
+{                                                                       \
+    return msp_req_send_async(msp, _cmd, NULL, 0,                       \
+                              msp_##_name##_retfn,                      \
+                              (void (*)(void))fn, priv);                \
+}
+
+/*
+ * Variable length responses are passed as received.
+ */
+#define MSP_CMD_ASYNC_VAR(_name, _cmd, _type)                           \
+static void                                                             \
+msp_##_name##_retfn(int err,                                            \
+                    const struct msp_hdr *hdr, void *data, void *priv)  \
+{                                                                       \
+    struct msp_cmd_async *async = priv;                                 \
+    msp_##_name##_fn fn = (msp_##_name##_fn)async->fn;                  \
+                                                                        \
+    fn(err, data, err ? 0 : hdr->len, async->priv);                     \
+                                                                        \
+    if (data)                                                           \
+        free(data);                                                     \
+    free(async);                                                        \
+}                                                                       \
+                                                                        \
+int                                                                     \
+msp_##_name##_async(struct msp *msp, msp_##_name##_fn fn, void *priv)   \
+{                                                                       \
+    return msp_req_send_async(msp, _cmd, NULL, 0,                       \
+                              msp_##_name##_retfn,                      \
+                              (void (*)(void))fn, priv);                \
+}
+
+#define MSP_CMD_ASYNC_DONE(_name, _cmd)                                 \
+int                                                                     \
+msp_##_name##_async(struct msp *msp, msp_done_fn fn, void *priv)        \
+{                                                                       \
+    return msp_req_send_async(msp, _cmd, NULL, 0,                       \
+                              msp_done_retfn,                           \
+                              (void (*)(void))fn, priv);                \
+}
+
+MSP_CMD_ASYNC(altitude, MSP_ALTITUDE, struct msp_altitude)
+MSP_CMD_ASYNC(analog, MSP_ANALOG, struct msp_analog)
+MSP_CMD_ASYNC(attitude, MSP_ATTITUDE, struct msp_attitude)
+MSP_CMD_ASYNC(ident, MSP_IDENT, struct msp_ident)
+MSP_CMD_ASYNC(motor, MSP_MOTOR, struct msp_motor)
+MSP_CMD_ASYNC(motor_pins, MSP_MOTOR_PINS, struct msp_motor_pins)
+MSP_CMD_ASYNC(raw_imu, MSP_RAW_IMU, struct msp_raw_imu)
+MSP_CMD_ASYNC(rc, MSP_RC, struct msp_raw_rc)
+MSP_CMD_ASYNC(servo, MSP_SERVO, struct msp_servo)
+MSP_CMD_ASYNC(status, MSP_STATUS, struct msp_status)
+
+MSP_CMD_ASYNC_VAR(box, MSP_BOX, uint16_t)
+MSP_CMD_ASYNC_VAR(boxids, MSP_BOXIDS, uint8_t)
+MSP_CMD_ASYNC_VAR(boxnames, MSP_BOXNAMES, char)
+
+MSP_CMD_ASYNC_DONE(acc_calibration, MSP_ACC_CALIBRATION)
+MSP_CMD_ASYNC_DONE(eeprom_write, MSP_EEPROM_WRITE)
+MSP_CMD_ASYNC_DONE(mag_calibration, MSP_MAG_CALIBRATION)
+MSP_CMD_ASYNC_DONE(reset_conf, MSP_RESET_CONF)
+
+int
+msp_set_raw_rc_async(struct msp *msp, const struct msp_raw_rc *rrc,
+                     msp_done_fn fn, void *priv)
+{
+    return msp_req_send_async(msp, MSP_SET_RAW_RC, rrc, sizeof(*rrc),
+                              msp_done_retfn, (void (*)(void))fn, priv);
+}
+
+int
+msp_set_box_async(struct msp *msp, const uint16_t *items, int cnt,
+                  msp_done_fn fn, void *priv)
+{
+    return msp_req_send_async(msp, MSP_SET_BOX,
+                              items, cnt * sizeof(*items),
+                              msp_done_retfn, (void (*)(void))fn, priv);
+}
@@ -3,8 +3,6 @@
 
 #include <msp/msp.h>
 
-#define MSP_CMD_TIMEOUT (struct timeval) { 1, 0 }
-
 int msp_acc_calibration(struct msp *msp);
 
 int msp_attitude(struct msp *msp, struct msp_attitude *att, size_t *len);
@@ -37,12 +35,78 @@ int msp_reset_conf(struct msp *msp);
 
 int msp_servo(struct msp *msp, struct msp_servo *servo, size_t *len);
 
-int msp_set_box(struct msp *msp, uint16_t *items, int cnt);
+int msp_set_box(struct msp *msp, const uint16_t *items, int cnt);
 
-int msp_set_raw_rc(struct msp *msp, struct msp_raw_rc *rrc);
+int msp_set_raw_rc(struct msp *msp, const struct msp_raw_rc *rrc);
 
 int msp_status(struct msp *msp, struct msp_status *st, size_t *len);
 
+/*
+ * Async variants. Each submits the request and returns, @fn gets
+ * the decoded response, or err, from the event loop. Fixed size
+ * responses arrive zero padded to the full struct, @len tells
+ * how much the FC sent. The response is only valid during @fn.
+ */
+#define MSP_CMD_FN(_name, _type)                                        \
+    typedef void (*msp_##_name##_fn)(int err, const _type *rsp,         \
+                                     size_t len, void *priv)
+
+typedef void (*msp_done_fn)(int err, void *priv);
+
+MSP_CMD_FN(altitude, struct msp_altitude);
+MSP_CMD_FN(analog, struct msp_analog);
+MSP_CMD_FN(attitude, struct msp_attitude);
+MSP_CMD_FN(box, uint16_t);
+MSP_CMD_FN(boxids, uint8_t);
+MSP_CMD_FN(boxnames, char);
+MSP_CMD_FN(ident, struct msp_ident);
+MSP_CMD_FN(motor, struct msp_motor);
+MSP_CMD_FN(motor_pins, struct msp_motor_pins);
+MSP_CMD_FN(raw_imu, struct msp_raw_imu);
+MSP_CMD_FN(rc, struct msp_raw_rc);
+MSP_CMD_FN(servo, struct msp_servo);
+MSP_CMD_FN(status, struct msp_status);
+
+int msp_acc_calibration_async(struct msp *msp, msp_done_fn fn, void *priv);
+
+int msp_altitude_async(struct msp *msp, msp_altitude_fn fn, void *priv);
+
+int msp_analog_async(struct msp *msp, msp_analog_fn fn, void *priv);
+
+int msp_attitude_async(struct msp *msp, msp_attitude_fn fn, void *priv);
+
+int msp_box_async(struct msp *msp, msp_box_fn fn, void *priv);
+
+int msp_boxids_async(struct msp *msp, msp_boxids_fn fn, void *priv);
+
+int msp_boxnames_async(struct msp *msp, msp_boxnames_fn fn, void *priv);
+
+int msp_eeprom_write_async(struct msp *msp, msp_done_fn fn, void *priv);
+
+int msp_ident_async(struct msp *msp, msp_ident_fn fn, void *priv);
+
+int msp_mag_calibration_async(struct msp *msp, msp_done_fn fn, void *priv);
+
+int msp_motor_async(struct msp *msp, msp_motor_fn fn, void *priv);
+
+int msp_motor_pins_async(struct msp *msp, msp_motor_pins_fn fn, void *priv);
+
+int msp_raw_imu_async(struct msp *msp, msp_raw_imu_fn fn, void *priv);
+
+int msp_rc_async(struct msp *msp, msp_rc_fn fn, void *priv);
+
+int msp_reset_conf_async(struct msp *msp, msp_done_fn fn, void *priv);
+
+int msp_servo_async(struct msp *msp, msp_servo_fn fn, void *priv);
+
+int msp_set_box_async(struct msp *msp, const uint16_t *items, int cnt,
+                      msp_done_fn fn, void *priv);
+
+int msp_set_raw_rc_async(struct msp *msp, const struct msp_raw_rc *rrc,
+                         msp_done_fn fn, void *priv);
+
+int msp_status_async(struct msp *msp, msp_status_fn fn, void *priv);
+
 #endif
 
 /*
@@ -4,15 +4,57 @@
 #include <msp/msg.h>
 #include <stdint.h>
 
+/*
+ * Payload layout, from the schema in msg.h. A field with @cnt 0
+ * repeats to the end of the payload, in messages of @var sized
+ * elements. @sub describes the elements of arrays of structs.
+ */
+struct msp_msg_field {
+    const char *name;
+    uint16_t off;
+    uint8_t size;
+    uint8_t cnt;
+    uint8_t opt;
+    const struct msp_msg_type *sub;
+};
+
+struct msp_msg_type {
+    const struct msp_msg_field *fields;
+    uint8_t nfields;
+    uint16_t min;
+    uint16_t max;
+    uint8_t var;
+};
+
 struct msp_msg_info {
     const char *tag; /* name */
     uint8_t sup; /* supported */
-    uint8_t min; /* min rsp len */
-    uint8_t max; /* max rsp len */
-    int (*req)(const struct msp_hdr *hdr, void *data); /* req encoder */
-    int (*rsp)(const struct msp_hdr *hdr, void *data); /* rsp decoder */
+    uint16_t min; /* min rsp len */
+    uint16_t max; /* max rsp len */
+    const struct msp_msg_type *req; /* req layout */
+    const struct msp_msg_type *rsp; /* rsp layout */
+    uint8_t read; /* safe to repeat */
+    msp_cmd_t drops; /* stale after a write, 0: none */
 };
 
+#define MSP_MSG_DROPS_ALL MSP_CMD_MAX
+
+extern const struct msp_msg_info msp_msg_infos[MSP_V1_CMD_MAX + 1];
+
+/*
+ * The info for @cmd. v2 commands past the table are unknown:
+ * no name, no schema, not supported.
+ */
+const struct msp_msg_info *msp_msg_info(msp_cmd_t cmd);
+
+uint8_t msp_msg_xor(uint8_t sum, const void *data, size_t len);
+
+/*
+ * Continue frame checksum @sum over @len bytes: XOR for '$' 'M'
+ * frames, CRC8-DVB-S2 for '$' 'X'.
+ */
+uint8_t msp_msg_sum(char tag, uint8_t sum, const void *data, size_t len);
+
 #endif
 
 /*
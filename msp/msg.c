@@ -6,356 +6,537 @@
 #include <msp/defs.h>
 #include <crt/defs.h>
 
-static int
-msp_ident_rsp_dec(const struct msp_hdr *hdr, void *data)
-{
-    struct msp_ident *ident = data;
-
-    ident->capabilities = avrtoh(ident->capabilities);
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
 
-    return 0;
-}
-
-static int
-msp_status_rsp_dec(const struct msp_hdr *hdr, void *data)
-{
-    struct msp_status *st = data;
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-    if (hdr->len >= msg_data_end(st, box)) {
-        st->cycle_time = avrtoh(st->cycle_time);
-        st->i2c_errcnt = avrtoh(st->i2c_errcnt);
-        st->hwcaps = avrtoh(st->hwcaps);;
-        st->box = avrtoh(st->box);
-    }
+#define MSP_MSG_FIELD_INFO(_x, _type, _name, _dim, _opt)               \
+    {                                                                   \
+        .name = #_name,                                                 \
+        .off = offsetof(struct _x, _name),                              \
+        .size = sizeof(_type),                                          \
+        .cnt = sizeof(_type _dim) / sizeof(_type),                      \
+        .opt = _opt,                                                    \
+    },
 
-    if (hdr->len >= msg_data_end(st, conf))
-        st->conf = avrtoh(st->conf);
+#define MSP_MSG_SUB_INFO(_x, _struct, _name, _dim, _opt)                \
+    {                                                                   \
+        .name = #_name,                                                 \
+        .off = offsetof(struct _x, _name),                              \
+        .size = sizeof(struct _struct),                                 \
+        .cnt = sizeof(struct _struct _dim) / sizeof(struct _struct),    \
+        .opt = _opt,                                                    \
+        .sub = &_struct##_type,                                         \
+    },
 
-    return 0;
-}
+#define MSP_MSG_FIELD_SIZE(_x, _type, _name, _dim, _opt)               \
+    + sizeof(_type _dim)
 
-static int
-msp_raw_imu_rsp_dec(const struct msp_hdr *hdr, void *data)
-{
-    struct msp_raw_imu *imu = data;
-    int i;
+#define MSP_MSG_SUB_SIZE(_x, _struct, _name, _dim, _opt)                \
+    + sizeof(struct _struct _dim)
 
-    for (i = 0; i < array_size(imu->acc); i++)
-        imu->acc[i] = avrtoh(imu->acc[i]);
+#define MSP_MSG_FIELD_OPT(_x, _type, _name, _dim, _opt)                \
+    + ((_opt) ? sizeof(_type _dim) : 0)
 
-    for (i = 0; i < array_size(imu->gyr); i++)
-        imu->gyr[i] = avrtoh(imu->gyr[i]);
+#define MSP_MSG_SUB_OPT(_x, _struct, _name, _dim, _opt)                 \
+    + ((_opt) ? sizeof(struct _struct _dim) : 0)
 
-    for (i = 0; i < array_size(imu->mag); i++)
-        imu->mag[i] = avrtoh(imu->mag[i]);
+/*
+ * Layout of struct @_struct, with its lengths as constants for
+ * the info table below. Optional fields come off the end.
+ */
+#define MSP_MSG_TYPE(_struct, _fields)                                  \
+    _Static_assert(sizeof(struct _struct) ==                            \
+                   0 _fields(MSP_MSG_FIELD_SIZE, MSP_MSG_SUB_SIZE, _),  \
+                   "struct " #_struct " has padding");                  \
+    _Static_assert(sizeof(struct _struct) <= MSP_LEN_MAX,               \
+                   "struct " #_struct " exceeds a frame");              \
+                                                                        \
+    enum {                                                              \
+        _struct##_max = sizeof(struct _struct),                         \
+        _struct##_min = _struct##_max -                                 \
+            (0 _fields(MSP_MSG_FIELD_OPT, MSP_MSG_SUB_OPT, _)),         \
+    };                                                                  \
+                                                                        \
+    static const struct msp_msg_field _struct##_fields[] = {            \
+        _fields(MSP_MSG_FIELD_INFO, MSP_MSG_SUB_INFO, _struct)          \
+    };                                                                  \
+                                                                        \
+    static const struct msp_msg_type _struct##_type = {                 \
+        .fields = _struct##_fields,                                     \
+        .nfields = array_size(_struct##_fields),                        \
+        .min = _struct##_min,                                           \
+        .max = _struct##_max,                                           \
+    }
 
-    return 0;
-}
+/*
+ * Payloads of @_elem to the end of the frame.
+ */
+#define MSP_MSG_ARRAY(_name, _elem)                                     \
+    enum {                                                              \
+        _name##_min = 0,                                                \
+        _name##_max = MSP_LEN_MAX - MSP_LEN_MAX % sizeof(_elem),        \
+    };                                                                  \
+                                                                        \
+    static const struct msp_msg_field _name##_fields[] = {              \
+        { .name = #_name, .size = sizeof(_elem) },                      \
+    };                                                                  \
+                                                                        \
+    static const struct msp_msg_type _name##_type = {                   \
+        .fields = _name##_fields,                                       \
+        .nfields = 1,                                                   \
+        .max = _name##_max,                                             \
+        .var = sizeof(_elem),                                           \
+    }
 
-static int
-msp_servo_rsp_dec(const struct msp_hdr *hdr, void *data)
-{
-    struct msp_servo *servo = data;
-    int i;
+enum {
+    msp_none_min = 0,
+    msp_none_max = 0,
+};
 
-    for (i = 0; i < array_size(servo->ctl); i++)
-        servo->ctl[i] = avrtoh(servo->ctl[i]);
+static const struct msp_msg_type msp_none_type;
+
+MSP_MSG_TYPE(msp_api_version, MSP_API_VERSION_FIELDS);
+MSP_MSG_TYPE(msp_ident, MSP_IDENT_FIELDS);
+MSP_MSG_TYPE(msp_status, MSP_STATUS_FIELDS);
+MSP_MSG_TYPE(msp_raw_imu, MSP_RAW_IMU_FIELDS);
+MSP_MSG_TYPE(msp_servo, MSP_SERVO_FIELDS);
+MSP_MSG_TYPE(msp_motor, MSP_MOTOR_FIELDS);
+MSP_MSG_TYPE(msp_raw_rc, MSP_RAW_RC_FIELDS);
+MSP_MSG_TYPE(msp_raw_gps, MSP_RAW_GPS_FIELDS);
+MSP_MSG_TYPE(msp_comp_gps, MSP_COMP_GPS_FIELDS);
+MSP_MSG_TYPE(msp_attitude, MSP_ATTITUDE_FIELDS);
+MSP_MSG_TYPE(msp_altitude, MSP_ALTITUDE_FIELDS);
+MSP_MSG_TYPE(msp_analog, MSP_ANALOG_FIELDS);
+MSP_MSG_TYPE(msp_rc_tuning, MSP_RC_TUNING_FIELDS);
+MSP_MSG_TYPE(msp_pid_item, MSP_PID_ITEM_FIELDS);
+MSP_MSG_TYPE(msp_pid, MSP_PID_FIELDS);
+MSP_MSG_TYPE(msp_misc, MSP_MISC_FIELDS);
+MSP_MSG_TYPE(msp_motor_pins, MSP_MOTOR_PINS_FIELDS);
+MSP_MSG_TYPE(msp_wp_req, MSP_WP_REQ_FIELDS);
+MSP_MSG_TYPE(msp_wp, MSP_WP_FIELDS);
+MSP_MSG_TYPE(msp_servo_conf_item, MSP_SERVO_CONF_ITEM_FIELDS);
+MSP_MSG_TYPE(msp_servo_conf, MSP_SERVO_CONF_FIELDS);
+MSP_MSG_TYPE(msp_set_raw_gps, MSP_SET_RAW_GPS_FIELDS);
+MSP_MSG_TYPE(msp_select_setting, MSP_SELECT_SETTING_FIELDS);
+MSP_MSG_TYPE(msp_set_head, MSP_SET_HEAD_FIELDS);
+MSP_MSG_TYPE(msp_debug, MSP_DEBUG_FIELDS);
+
+MSP_MSG_ARRAY(msp_u8s, uint8_t);
+MSP_MSG_ARRAY(msp_u16s, uint16_t);
+
+#define MSP_MSG(_tag, _req, _rsp)                                       \
+        .tag = _tag,                                                    \
+        .sup = 1,                                                       \
+        .min = _rsp##_min,                                              \
+        .max = _rsp##_max,                                              \
+        .req = &_req##_type,                                            \
+        .rsp = &_rsp##_type
 
-    return 0;
-}
+/*
+ * Reads are safe to repeat. Anything else changes state on the
+ * FC, and is answered with an empty ack. It makes the cached
+ * response to @_drops stale, every cached response if
+ * MSP_MSG_DROPS_ALL, or none if 0.
+ */
+#define MSP_MSG_GET(_cmd, _req, _rsp)                                   \
+    [_cmd] = { MSP_MSG(#_cmd, _req, _rsp), .read = 1 }
+
+#define MSP_MSG_SET(_cmd, _req, _drops)                                 \
+    [_cmd] = { MSP_MSG(#_cmd, _req, msp_none), .drops = _drops }
+
+const struct msp_msg_info msp_msg_infos[MSP_V1_CMD_MAX + 1] = {
+    MSP_MSG_GET(MSP_API_VERSION,     msp_u8s,            msp_api_version),
+    MSP_MSG_GET(MSP_IDENT,           msp_none,           msp_ident),
+    MSP_MSG_GET(MSP_STATUS,          msp_none,           msp_status),
+    MSP_MSG_GET(MSP_RAW_IMU,         msp_none,           msp_raw_imu),
+    MSP_MSG_GET(MSP_SERVO,           msp_none,           msp_servo),
+    MSP_MSG_GET(MSP_MOTOR,           msp_none,           msp_motor),
+    MSP_MSG_GET(MSP_RC,              msp_none,           msp_raw_rc),
+    MSP_MSG_GET(MSP_RAW_GPS,         msp_none,           msp_raw_gps),
+    MSP_MSG_GET(MSP_COMP_GPS,        msp_none,           msp_comp_gps),
+    MSP_MSG_GET(MSP_ATTITUDE,        msp_none,           msp_attitude),
+    MSP_MSG_GET(MSP_ALTITUDE,        msp_none,           msp_altitude),
+    MSP_MSG_GET(MSP_ANALOG,          msp_none,           msp_analog),
+    MSP_MSG_GET(MSP_RC_TUNING,       msp_none,           msp_rc_tuning),
+    MSP_MSG_GET(MSP_PID,             msp_none,           msp_pid),
+    MSP_MSG_GET(MSP_BOX,             msp_none,           msp_u16s),
+    MSP_MSG_GET(MSP_MISC,            msp_none,           msp_misc),
+    MSP_MSG_GET(MSP_MOTOR_PINS,      msp_none,           msp_motor_pins),
+    MSP_MSG_GET(MSP_BOXNAMES,        msp_none,           msp_u8s),
+    MSP_MSG_GET(MSP_PIDNAMES,        msp_none,           msp_u8s),
+    MSP_MSG_GET(MSP_WP,              msp_wp_req,         msp_wp),
+    MSP_MSG_GET(MSP_BOXIDS,          msp_none,           msp_u8s),
+    MSP_MSG_GET(MSP_SERVO_CONF,      msp_none,           msp_servo_conf),
+    MSP_MSG_SET(MSP_SET_RAW_RC,      msp_raw_rc,         MSP_RC),
+    MSP_MSG_SET(MSP_SET_RAW_GPS,     msp_set_raw_gps,    MSP_RAW_GPS),
+    MSP_MSG_SET(MSP_SET_PID,         msp_pid,            MSP_PID),
+    MSP_MSG_SET(MSP_SET_BOX,         msp_u16s,           MSP_BOX),
+    MSP_MSG_SET(MSP_SET_RC_TUNING,   msp_rc_tuning,      MSP_RC_TUNING),
+    MSP_MSG_SET(MSP_ACC_CALIBRATION, msp_none,           MSP_MSG_DROPS_ALL),
+    MSP_MSG_SET(MSP_MAG_CALIBRATION, msp_none,           MSP_MSG_DROPS_ALL),
+    MSP_MSG_SET(MSP_SET_MISC,        msp_misc,           MSP_MISC),
+    MSP_MSG_SET(MSP_RESET_CONF,      msp_none,           MSP_MSG_DROPS_ALL),
+    MSP_MSG_SET(MSP_SET_WP,          msp_wp,             MSP_WP),
+    MSP_MSG_SET(MSP_SELECT_SETTING,  msp_select_setting, MSP_MSG_DROPS_ALL),
+    MSP_MSG_SET(MSP_SET_HEAD,        msp_set_head,       0),
+    MSP_MSG_SET(MSP_SET_SERVO_CONF,  msp_servo_conf,     MSP_SERVO_CONF),
+    MSP_MSG_SET(MSP_SET_MOTOR,       msp_motor,          MSP_MOTOR),
+    MSP_MSG_SET(MSP_BIND,            msp_none,           MSP_MSG_DROPS_ALL),
+    MSP_MSG_SET(MSP_EEPROM_WRITE,    msp_none,           MSP_MSG_DROPS_ALL),
+    MSP_MSG_GET(MSP_DEBUGMSG,        msp_none,           msp_u8s),
+    MSP_MSG_GET(MSP_DEBUG,           msp_none,           msp_debug),
+};
 
 static int
-msp_motor_rsp_dec(const struct msp_hdr *hdr, void *data)
+msp_msg_check(const struct msp_msg_type *type, size_t len)
 {
-    struct msp_motor *motor = data;
-    int i;
+    if (len < type->min || len > type->max) {
+        errno = EILSEQ;
+        return -1;
+    }
 
-    for (i = 0; i < array_size(motor->ctl); i++)
-        motor->ctl[i] = avrtoh(motor->ctl[i]);
+    if (type->var && len % type->var) {
+        errno = EPROTO;
+        return -1;
+    }
 
     return 0;
 }
 
+/*
+ * Convert @data between wire and host byte order in place, and
+ * return the number of values swapped. Little-endian hosts have
+ * nothing to do.
+ */
 static int
-msp_rc_rsp_dec(const struct msp_hdr *hdr, void *data)
+msp_msg_swap(const struct msp_msg_type *type, uint8_t *data, size_t len)
 {
-    struct msp_raw_rc *rrc = data;
-    int i;
-
-    for (i = 0; i < array_size(rrc->chn); i++)
-        rrc->chn[i] = avrtoh(rrc->chn[i]);
-
-    return 0;
+    int n = 0;
+#if __BYTE_ORDER == __BIG_ENDIAN
+    const struct msp_msg_field *f;
+
+    for (f = type->fields; f < type->fields + type->nfields; f++) {
+        size_t off;
+        int i, cnt;
+
+        if (f->size == 1)
+            continue;
+
+        cnt = f->cnt ? : (len - f->off) / f->size;
+
+        for (i = 0, off = f->off; i < cnt; i++, off += f->size) {
+            uint8_t *pos = data + off;
+
+            if (off + f->size > len)
+                return n;
+
+            if (f->sub) {
+                n += msp_msg_swap(f->sub, pos, f->size);
+                continue;
+            }
+
+            switch (f->size) {
+            case 2: {
+                uint16_t v;
+
+                memcpy(&v, pos, sizeof(v));
+                v = avrtoh(v);
+                memcpy(pos, &v, sizeof(v));
+                break;
+            }
+            case 4: {
+                uint32_t v;
+
+                memcpy(&v, pos, sizeof(v));
+                v = avrtoh(v);
+                memcpy(pos, &v, sizeof(v));
+                break;
+            }
+            }
+            n++;
+        }
+    }
+#endif
+    return n;
 }
 
-static int
-msp_attitude_rsp_dec(const struct msp_hdr *hdr, void *data)
+/*
+ * CRC8-DVB-S2, polynomial 0xd5, one table lookup per byte.
+ */
+static const uint8_t msp_crc8_tab[256] = {
+    0x00, 0xd5, 0x7f, 0xaa, 0xfe, 0x2b, 0x81, 0x54,
+    0x29, 0xfc, 0x56, 0x83, 0xd7, 0x02, 0xa8, 0x7d,
+    0x52, 0x87, 0x2d, 0xf8, 0xac, 0x79, 0xd3, 0x06,
+    0x7b, 0xae, 0x04, 0xd1, 0x85, 0x50, 0xfa, 0x2f,
+    0xa4, 0x71, 0xdb, 0x0e, 0x5a, 0x8f, 0x25, 0xf0,
+    0x8d, 0x58, 0xf2, 0x27, 0x73, 0xa6, 0x0c, 0xd9,
+    0xf6, 0x23, 0x89, 0x5c, 0x08, 0xdd, 0x77, 0xa2,
+    0xdf, 0x0a, 0xa0, 0x75, 0x21, 0xf4, 0x5e, 0x8b,
+    0x9d, 0x48, 0xe2, 0x37, 0x63, 0xb6, 0x1c, 0xc9,
+    0xb4, 0x61, 0xcb, 0x1e, 0x4a, 0x9f, 0x35, 0xe0,
+    0xcf, 0x1a, 0xb0, 0x65, 0x31, 0xe4, 0x4e, 0x9b,
+    0xe6, 0x33, 0x99, 0x4c, 0x18, 0xcd, 0x67, 0xb2,
+    0x39, 0xec, 0x46, 0x93, 0xc7, 0x12, 0xb8, 0x6d,
+    0x10, 0xc5, 0x6f, 0xba, 0xee, 0x3b, 0x91, 0x44,
+    0x6b, 0xbe, 0x14, 0xc1, 0x95, 0x40, 0xea, 0x3f,
+    0x42, 0x97, 0x3d, 0xe8, 0xbc, 0x69, 0xc3, 0x16,
+    0xef, 0x3a, 0x90, 0x45, 0x11, 0xc4, 0x6e, 0xbb,
+    0xc6, 0x13, 0xb9, 0x6c, 0x38, 0xed, 0x47, 0x92,
+    0xbd, 0x68, 0xc2, 0x17, 0x43, 0x96, 0x3c, 0xe9,
+    0x94, 0x41, 0xeb, 0x3e, 0x6a, 0xbf, 0x15, 0xc0,
+    0x4b, 0x9e, 0x34, 0xe1, 0xb5, 0x60, 0xca, 0x1f,
+    0x62, 0xb7, 0x1d, 0xc8, 0x9c, 0x49, 0xe3, 0x36,
+    0x19, 0xcc, 0x66, 0xb3, 0xe7, 0x32, 0x98, 0x4d,
+    0x30, 0xe5, 0x4f, 0x9a, 0xce, 0x1b, 0xb1, 0x64,
+    0x72, 0xa7, 0x0d, 0xd8, 0x8c, 0x59, 0xf3, 0x26,
+    0x5b, 0x8e, 0x24, 0xf1, 0xa5, 0x70, 0xda, 0x0f,
+    0x20, 0xf5, 0x5f, 0x8a, 0xde, 0x0b, 0xa1, 0x74,
+    0x09, 0xdc, 0x76, 0xa3, 0xf7, 0x22, 0x88, 0x5d,
+    0xd6, 0x03, 0xa9, 0x7c, 0x28, 0xfd, 0x57, 0x82,
+    0xff, 0x2a, 0x80, 0x55, 0x01, 0xd4, 0x7e, 0xab,
+    0x84, 0x51, 0xfb, 0x2e, 0x7a, 0xaf, 0x05, 0xd0,
+    0xad, 0x78, 0xd2, 0x07, 0x53, 0x86, 0x2c, 0xf9,
+};
+
+uint8_t
+msp_crc8_dvb_s2(uint8_t crc, const void *data, size_t len)
 {
-    struct msp_attitude *att = data;
+    const uint8_t *pos = data;
 
-    att->roll = avrtoh(att->roll);
-    att->pitch = avrtoh(att->pitch);
-    att->yaw = avrtoh(att->yaw);
-    att->yawtf = avrtoh(att->yawtf);
+    while (len--)
+        crc = msp_crc8_tab[crc ^ *pos++];
 
-    return 0;
+    return crc;
 }
 
-static int
-msp_altitude_rsp_dec(const struct msp_hdr *hdr, void *data)
+/*
+ * The XOR of the words of @data folds down to the XOR of its
+ * bytes, so take it 16 or 8 bytes at a time.
+ */
+uint8_t
+msp_msg_xor(uint8_t sum, const void *data, size_t len)
 {
-    struct msp_altitude *alt = data;
+    const uint8_t *pos = data;
+    uint64_t acc = 0;
 
-    alt->altitude = avrtoh(alt->altitude);
-    alt->variometer = avrtoh(alt->variometer);
+#ifdef __SSE2__
+    if (len >= 32) {
+        __m128i v = _mm_setzero_si128();
+        uint64_t w[2];
 
-    return 0;
-}
-
-static int
-msp_analog_rsp_dec(const struct msp_hdr *hdr, void *data)
-{
-    struct msp_analog *analog = data;
+        for (; len >= 16; pos += 16, len -= 16)
+            v = _mm_xor_si128(v, _mm_loadu_si128((const __m128i *)pos));
 
-    analog->powermetersum = avrtoh(analog->powermetersum);
+        _mm_storeu_si128((__m128i *)w, v);
+        acc = w[0] ^ w[1];
+    }
+#endif
+    for (; len >= sizeof(acc); pos += sizeof(acc), len -= sizeof(acc)) {
+        uint64_t w;
 
-    if (hdr->len >= msg_data_end(analog, rssi))
-        analog->rssi = avrtoh(analog->rssi);
+        memcpy(&w, pos, sizeof(w));
+        acc ^= w;
+    }
 
-    return 0;
-}
+    if (len & 4) {
+        uint32_t w;
 
-static int
-msp_box_rsp_dec(const struct msp_hdr *hdr, void *data)
-{
-    uint16_t *box = data;
-    int rc, cnt, i;
+        memcpy(&w, pos, sizeof(w));
+        acc ^= w;
+        pos += sizeof(w);
+    }
 
-    rc = -1;
+    if (len & 2) {
+        uint16_t w;
 
-    if (unexpected(hdr->len % sizeof(*box))) {
-        errno = EPROTO;
-        goto out;
+        memcpy(&w, pos, sizeof(w));
+        acc ^= w;
+        pos += sizeof(w);
     }
 
-    cnt = hdr->len / sizeof(*box);
+    if (len & 1)
+        acc ^= *pos;
 
-    for (i = 0; i < cnt; i++)
-        box[i] = avrtoh(box[i]);
+    acc ^= acc >> 32;
+    acc ^= acc >> 16;
+    acc ^= acc >> 8;
 
-    rc = 0;
-out:
-    return rc;
+    return sum ^ (uint8_t)acc;
 }
 
-static int
-msp_set_raw_rc_req_enc(const struct msp_hdr *hdr, void *data)
+uint8_t
+msp_msg_sum(char tag, uint8_t sum, const void *data, size_t len)
 {
-    struct msp_raw_rc *rrc = data;
-    int i;
-
-    for (i = 0; i < array_size(rrc->chn); i++)
-        rrc->chn[i] = htoavr(rrc->chn[i]);
+    if (tag == 'X')
+        return msp_crc8_dvb_s2(sum, data, len);
 
-    return 0;
+    return msp_msg_xor(sum, data, len);
 }
 
-static int
-msp_set_box_req_enc(const struct msp_hdr *hdr, void *data)
+size_t
+msp_hdr_encode(const struct msp_hdr *hdr, void *buf)
 {
-    uint16_t *items = data;
-    int rc, cnt, i;
-
-    rc = -1;
-
-    if (unexpected(hdr->len % sizeof(*items))) {
-        errno = EPROTO;
-        goto out;
+    uint8_t *pos = buf;
+
+    *pos++ = hdr->tag[0];
+    *pos++ = hdr->tag[1];
+    *pos++ = hdr->dsc;
+
+    if (hdr->tag[1] == 'X') {
+        *pos++ = 0; /* flag */
+        *pos++ = hdr->cmd & 0xff;
+        *pos++ = hdr->cmd >> 8;
+        *pos++ = hdr->len & 0xff;
+        *pos++ = hdr->len >> 8;
+    } else if (hdr->len >= MSP_JUMBO_LEN) {
+        *pos++ = MSP_JUMBO_LEN;
+        *pos++ = hdr->cmd;
+        *pos++ = hdr->len & 0xff;
+        *pos++ = hdr->len >> 8;
+    } else {
+        *pos++ = hdr->len;
+        *pos++ = hdr->cmd;
     }
 
-    cnt = hdr->len / sizeof(*items);
+    return pos - (uint8_t *)buf;
+}
 
-    for (i = 0; i < cnt; i++)
-        items[i] = htoavr(items[i]);
+const struct msp_msg_info *
+msp_msg_info(msp_cmd_t cmd)
+{
+    static const struct msp_msg_info unknown;
 
-    rc = 0;
-out:
-    return rc;
+    return cmd <= MSP_V1_CMD_MAX ? &msp_msg_infos[cmd] : &unknown;
 }
 
-const struct msp_msg_info msp_msg_infos[MSP_CMD_MAX] = {
-    [MSP_IDENT] = {
-        .tag = "MSP_IDENT",
-        .sup = 1,
-        .min = sizeof(struct msp_ident),
-        .max = sizeof(struct msp_ident),
-        .req = NULL,
-        .rsp = msp_ident_rsp_dec,
-    },
-    [MSP_STATUS] = {
-        .tag = "MSP_STATUS",
-        .sup = 1,
-        .min = msg_type_end(struct msp_status, box),
-        .max = sizeof(struct msp_status),
-        .req = NULL,
-        .rsp = msp_status_rsp_dec,
-    },
-    [MSP_RAW_IMU] = {
-        .tag = "MSP_RAW_IMU",
-        .sup = 1,
-        .min = sizeof(struct msp_raw_imu),
-        .max = sizeof(struct msp_raw_imu),
-        .req = NULL,
-        .rsp = msp_raw_imu_rsp_dec,
-    },
-    [MSP_SERVO] = {
-        .tag = "MSP_SERVO",
-        .sup = 1,
-        .min = sizeof(struct msp_servo),
-        .max = sizeof(struct msp_servo),
-        .req = NULL,
-        .rsp = msp_servo_rsp_dec,
-    },
-    [MSP_MOTOR] = {
-        .tag = "MSP_MOTOR",
-        .sup = 1,
-        .min = sizeof(struct msp_motor),
-        .max = sizeof(struct msp_motor),
-        .req = NULL,
-        .rsp = msp_motor_rsp_dec,
-    },
-    [MSP_RC] = {
-        .tag = "MSP_RC",
-        .sup = 1,
-        .min = sizeof(struct msp_raw_rc),
-        .max = sizeof(struct msp_raw_rc),
-        .req = NULL,
-        .rsp = msp_rc_rsp_dec,
-    },
-    [MSP_ATTITUDE] = {
-        .tag = "MSP_ATTITUDE",
-        .sup = 1,
-        .min = sizeof(struct msp_attitude),
-        .max = sizeof(struct msp_attitude),
-        .req = NULL,
-        .rsp = msp_attitude_rsp_dec,
-    },
-    [MSP_ALTITUDE] = {
-        .tag = "MSP_ALTITUDE",
-        .sup = 1,
-        .min = msg_type_end(struct msp_altitude, altitude),
-        .max = msg_type_end(struct msp_altitude, variometer),
-        .req = NULL,
-        .rsp = msp_altitude_rsp_dec,
-    },
-    [MSP_ANALOG] = {
-        .tag = "MSP_ANALOG",
-        .sup = 1,
-        .min = msg_type_end(struct msp_analog, powermetersum),
-        .max = msg_type_end(struct msp_analog, rssi),
-        .req = NULL,
-        .rsp = msp_analog_rsp_dec,
-    },
-    [MSP_BOX] = {
-        .tag = "MSP_BOX",
-        .sup = 1,
-        .min = 0,
-        .max = MSP_LEN_MAX,
-        .req = NULL,
-        .rsp = msp_box_rsp_dec,
-    },
-    [MSP_MOTOR_PINS] = {
-        .tag = "MSP_PINS",
-        .sup = 1,
-        .min = sizeof(struct msp_motor_pins),
-        .max = sizeof(struct msp_motor_pins),
-        .req = NULL,
-        .rsp = NULL,
-    },
-    [MSP_BOXNAMES] = {
-        .tag = "MSP_BOXNAMES",
-        .sup = 1,
-        .min = 0,
-        .max = MSP_LEN_MAX,
-        .req = NULL,
-        .rsp = NULL,
-    },
-    [MSP_BOXIDS] = {
-        .tag = "MSP_BOXIDS",
-        .sup = 1,
-        .min = 0,
-        .max = MSP_LEN_MAX,
-        .req = NULL,
-        .rsp = NULL,
-    },
-    [MSP_SET_RAW_RC] = {
-        .tag = "MSP_SET_RAW_RC",
-        .sup = 1,
-        .min = 0,
-        .max = 0,
-        .req = msp_set_raw_rc_req_enc,
-        .rsp = NULL,
-    },
-    [MSP_SET_BOX] = {
-        .tag = "MSP_SET_BOX",
-        .sup = 1,
-        .min = 0,
-        .max = MSP_LEN_MAX,
-        .req = msp_set_box_req_enc,
-        .rsp = NULL,
-    },
-    [MSP_ACC_CALIBRATION] = {
-        .tag = "MSP_ACC_CALIBRATION",
-        .sup = 1,
-        .min = 0,
-        .max = 0,
-        .req = NULL,
-        .rsp = NULL,
-    },
-    [MSP_MAG_CALIBRATION] = {
-        .tag = "MSP_MAG_CALIBRATION",
-        .sup = 1,
-        .min = 0,
-        .max = 0,
-        .req = NULL,
-        .rsp = NULL,
-    },
-    [MSP_RESET_CONF] = {
-        .tag = "MSP_RESET_CONF",
-        .sup = 1,
-        .min = 0,
-        .max = 0,
-        .req = NULL,
-        .rsp = NULL,
-    },
-    [MSP_EEPROM_WRITE] = {
-        .tag = "MSP_EEPROM_WRITE",
-        .sup = 1,
-        .min = 0,
-        .max = 0,
-        .req = NULL,
-        .rsp = NULL,
-    },
+/*
+ * Encoder output, with the checksum accumulated as bytes are
+ * written.
+ */
+struct msp_enc {
+    uint8_t *pos;
+    uint8_t cks;
+    char tag;
 };
 
+static void
+msp_enc_put(struct msp_enc *enc, const void *data, size_t len)
+{
+    const uint8_t *pos = data;
+
+    if (enc->tag == 'X') {
+        while (len--) {
+            enc->cks = msp_crc8_tab[enc->cks ^ *pos];
+            *enc->pos++ = *pos++;
+        }
+        return;
+    }
+
+    while (len--) {
+        enc->cks ^= *pos;
+        *enc->pos++ = *pos++;
+    }
+}
+
+/*
+ * Copy @len bytes of @type from @args, in wire byte order. Only
+ * big-endian hosts walk the fields, to swap them on the way.
+ */
+static void
+msp_enc_type(struct msp_enc *enc, const struct msp_msg_type *type,
+             const uint8_t *args, size_t len)
+{
+    size_t off = 0;
+#if __BYTE_ORDER == __BIG_ENDIAN
+    const struct msp_msg_field *f;
+
+    for (f = type->fields; f < type->fields + type->nfields; f++) {
+        int i, cnt;
+
+        cnt = f->cnt ? : (len - f->off) / f->size;
+
+        for (i = 0, off = f->off; i < cnt; i++, off += f->size) {
+            const uint8_t *pos = args + off;
+
+            if (off + f->size > len)
+                goto tail;
+
+            if (f->sub) {
+                msp_enc_type(enc, f->sub, pos, f->size);
+                continue;
+            }
+
+            switch (f->size) {
+            case 2: {
+                uint16_t v;
+
+                memcpy(&v, pos, sizeof(v));
+                v = htoavr(v);
+                msp_enc_put(enc, &v, sizeof(v));
+                break;
+            }
+            case 4: {
+                uint32_t v;
+
+                memcpy(&v, pos, sizeof(v));
+                v = htoavr(v);
+                msp_enc_put(enc, &v, sizeof(v));
+                break;
+            }
+            default:
+                msp_enc_put(enc, pos, f->size);
+                break;
+            }
+        }
+    }
+tail:
+#endif
+    msp_enc_put(enc, args + off, len - off);
+}
+
 int
-msp_msg_encode_req(const struct msp_hdr *hdr, void *data)
+msp_msg_encode_req(const struct msp_hdr *hdr, const void *args,
+                   void *buf, uint8_t *cks)
 {
     const struct msp_msg_info *info;
+    uint8_t head[MSP_HDR_MAX];
+    struct msp_enc enc;
+    size_t n;
     int rc;
 
     rc = -1;
-    info = &msp_msg_infos[hdr->cmd];
+    info = msp_msg_info(hdr->cmd);
 
-    if (!info->sup) {
+    /* v2 commands have no schema here, and go out as given */
+    if (!info->sup && hdr->cmd <= MSP_V1_CMD_MAX) {
         errno = EINVAL;
         goto out;
     }
 
-    if (info->req)
-        rc = info->req(hdr, data);
+    rc = info->sup ? msp_msg_check(info->req, hdr->len) : 0;
+    if (unexpected(rc))
+        goto out;
+
+    n = msp_hdr_encode(hdr, head);
+
+    enc = (struct msp_enc) {
+        .pos = buf,
+        .cks = msp_msg_sum(hdr->tag[1], 0, head + 3, n - 3),
+        .tag = hdr->tag[1],
+    };
+
+    /* copy, swap and sum in one pass */
+    if (info->sup)
+        msp_enc_type(&enc, info->req, args, hdr->len);
     else
-        rc = 0;
+        msp_enc_put(&enc, args, hdr->len);
+
+    *cks = enc.cks;
 out:
     return rc;
 }
@@ -367,49 +548,44 @@ msp_msg_decode_rsp(const struct msp_hdr *hdr, void *data)
     int rc;
 
     rc = -1;
-    info = &msp_msg_infos[hdr->cmd];
+    info = msp_msg_info(hdr->cmd);
 
+    /* and v2 responses come back raw */
     if (!info->sup) {
-        errno = EPROTO;
+        if (hdr->cmd > MSP_V1_CMD_MAX)
+            rc = 0;
+        else
+            errno = EPROTO;
         goto out;
     }
 
-    if (unexpected(hdr->len < info->min) ||
-        unexpected(hdr->len > info->max)) {
-        errno = EILSEQ;
+    rc = msp_msg_check(info->rsp, hdr->len);
+    if (unexpected(rc))
         goto out;
-    }
 
-    if (info->rsp)
-        rc = info->rsp(hdr, data);
-    else
-        rc = 0;
+    msp_msg_swap(info->rsp, data, hdr->len);
 out:
     return rc;
 }
 
 uint8_t
-msp_msg_checksum(const struct msp_hdr *hdr, const void *_data)
+msp_msg_checksum(const struct msp_hdr *hdr, const void *data)
 {
-    const uint8_t *pos;
-    msp_len_t len;
+    uint8_t head[MSP_HDR_MAX];
     uint8_t cks;
+    size_t n;
 
-    pos = _data;
+    n = msp_hdr_encode(hdr, head);
 
-    len = hdr->len;
-    cks = hdr->cmd ^ len;
-
-    while (len--)
-        cks ^= *pos++;
+    cks = msp_msg_sum(hdr->tag[1], 0, head + 3, n - 3);
 
-    return cks;
+    return msp_msg_sum(hdr->tag[1], cks, data, hdr->len);
 }
 
 const char *
 msp_cmd_name(msp_cmd_t cmd)
 {
-    return msp_msg_infos[cmd].tag;
+    return msp_msg_info(cmd)->tag;
 }
 
 /*
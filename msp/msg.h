@@ -2,29 +2,61 @@
 #define MSP_MSG_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #if __GNUC__
 #define PACKED __attribute__((packed))
 #endif
 
 /*
- * Multiwii Serial Protocol v0
+ * Message schema. MSP_<CMD>_FIELDS(_F, _S, _x) lists a payload
+ * as _F(_x, type, name, dim, opt) per field, or _S(...) for an
+ * array of a struct with a schema of its own. @dim is empty or
+ * an array dimension, @opt marks trailing fields older firmware
+ * leaves out. Multi-byte fields are little-endian on the wire.
+ * The structs below, and the codecs in msg.c, are built from
+ * the same lists.
+ */
+#define MSP_MSG_FIELD(_x, _type, _name, _dim, _opt) _type _name _dim;
+#define MSP_MSG_SUB(_x, _struct, _name, _dim, _opt) struct _struct _name _dim;
+
+#define MSP_MSG_STRUCT(_struct, _fields)                        \
+    struct _struct {                                            \
+        _fields(MSP_MSG_FIELD, MSP_MSG_SUB, _struct)            \
+    } PACKED
+
+/*
+ * Multiwii Serial Protocol v0, with v1 jumbo frames and v2
+ * framing. Commands past MSP_V1_CMD_MAX only fit v2 frames.
  */
 #define MSP_VERSION             0
 
-typedef uint8_t msp_len_t;
-typedef uint8_t msp_cmd_t;
+typedef uint16_t msp_len_t;
+typedef uint16_t msp_cmd_t;
 
+/*
+ * A frame header, decoded. On the wire, '$' 'M' frames carry an
+ * 8-bit length and command, or in v1 jumbo frames a length of
+ * 255 followed by the 16-bit one. '$' 'X' (v2) frames carry a
+ * flag byte, a 16-bit command and length, little endian, and a
+ * CRC8-DVB-S2 checksum in place of the XOR.
+ */
 struct msp_hdr {
-    char tag[2]; /* '$' 'M' */
-    char dsc;    /* '>': req, '<': rsp, '!': err */
+    char tag[2]; /* '$' 'M' or '$' 'X' */
+    char dsc;    /* '<': req, '>': rsp, '!': err */
     msp_len_t len;
     msp_cmd_t cmd;
-} PACKED;
+};
 
-#define MSP_CMD_MIN MSP_IDENT
-#define MSP_CMD_MAX UINT8_MAX
-#define MSP_LEN_MAX UINT8_MAX
+#define MSP_HDR_MIN 5 /* v0 */
+#define MSP_HDR_MAX 8 /* v2 */
+
+#define MSP_CMD_MIN MSP_API_VERSION
+#define MSP_V1_CMD_MAX UINT8_MAX
+#define MSP_CMD_MAX UINT16_MAX
+#define MSP_LEN_MAX 1024
+#define MSP_V0_LEN_MAX UINT8_MAX
+#define MSP_JUMBO_LEN UINT8_MAX
 
 #define MSP_REQ_HDR(_cmd, _len)                     \
     (struct msp_hdr) {                              \
@@ -35,6 +67,24 @@ struct msp_hdr {
         .cmd = (_cmd),                              \
     }
 
+/*
+ * get
+ *   protocol version
+ *   api version major
+ *   api version minor
+ *
+ * Not in MultiWii. The firmware which answers it reads jumbo
+ * frames, and ignores any payload sent along.
+ */
+#define MSP_API_VERSION         1
+
+#define MSP_API_VERSION_FIELDS(_F, _S, _x)                      \
+    _F(_x, uint8_t,  protocol,     , 0)                         \
+    _F(_x, uint8_t,  api_major,    , 0)                         \
+    _F(_x, uint8_t,  api_minor,    , 0)
+
+MSP_MSG_STRUCT(msp_api_version, MSP_API_VERSION_FIELDS);
+
 /*
  * get
  *   multitype
@@ -44,12 +94,13 @@ struct msp_hdr {
  */
 #define MSP_IDENT               100
 
-struct msp_ident {
-    uint8_t     fwversion;
-    uint8_t     multitype;
-    uint8_t     mspversion;
-    uint32_t    capabilities;
-} PACKED;
+#define MSP_IDENT_FIELDS(_F, _S, _x)                            \
+    _F(_x, uint8_t,  fwversion,    , 0)                         \
+    _F(_x, uint8_t,  multitype,    , 0)                         \
+    _F(_x, uint8_t,  mspversion,   , 0)                         \
+    _F(_x, uint32_t, capabilities, , 0)
+
+MSP_MSG_STRUCT(msp_ident, MSP_IDENT_FIELDS);
 
 enum msp_multitype {
     MSP_MULTITYPE_TRI = 1,
@@ -85,13 +136,14 @@ enum msp_multitype {
  */
 #define MSP_STATUS              101
 
-struct msp_status {
-    uint16_t cycle_time;
-    uint16_t i2c_errcnt;
-    uint16_t hwcaps;
-    uint32_t box;
-    uint8_t conf;
-} PACKED;
+#define MSP_STATUS_FIELDS(_F, _S, _x)                           \
+    _F(_x, uint16_t, cycle_time, , 0)                           \
+    _F(_x, uint16_t, i2c_errcnt, , 0)                           \
+    _F(_x, uint16_t, hwcaps,     , 0)                           \
+    _F(_x, uint32_t, box,        , 0)                           \
+    _F(_x, uint8_t,  conf,       , 1)
+
+MSP_MSG_STRUCT(msp_status, MSP_STATUS_FIELDS);
 
 #define MSP_STATUS_HWCAP_ACC     (1<<0)
 #define MSP_STATUS_HWCAP_BARO    (1<<1)
@@ -120,11 +172,12 @@ struct msp_status {
  */
 #define MSP_RAW_IMU             102
 
-struct msp_raw_imu {
-    int16_t acc[3];
-    int16_t gyr[3];
-    int16_t mag[3];
-};
+#define MSP_RAW_IMU_FIELDS(_F, _S, _x)                          \
+    _F(_x, int16_t, acc, [3], 0)                                \
+    _F(_x, int16_t, gyr, [3], 0)                                \
+    _F(_x, int16_t, mag, [3], 0)
+
+MSP_MSG_STRUCT(msp_raw_imu, MSP_RAW_IMU_FIELDS);
 
 /*
  * get
@@ -132,9 +185,10 @@ struct msp_raw_imu {
  */
 #define MSP_SERVO               103
 
-struct msp_servo {
-    int16_t ctl[8];
-};
+#define MSP_SERVO_FIELDS(_F, _S, _x)                            \
+    _F(_x, int16_t, ctl, [8], 0)
+
+MSP_MSG_STRUCT(msp_servo, MSP_SERVO_FIELDS);
 
 /*
  * get
@@ -142,9 +196,10 @@ struct msp_servo {
  */
 #define MSP_MOTOR               104
 
-struct msp_motor {
-    int16_t ctl[8];
-};
+#define MSP_MOTOR_FIELDS(_F, _S, _x)                            \
+    _F(_x, int16_t, ctl, [8], 0)
+
+MSP_MSG_STRUCT(msp_motor, MSP_MOTOR_FIELDS);
 
 /*
  * get
@@ -165,9 +220,10 @@ enum msp_rc_chn {
 
 #define MSP_N_CHANNELS    8
 
-struct msp_raw_rc {
-    int16_t chn[MSP_N_CHANNELS];
-};
+#define MSP_RAW_RC_FIELDS(_F, _S, _x)                           \
+    _F(_x, int16_t, chn, [MSP_N_CHANNELS], 0)
+
+MSP_MSG_STRUCT(msp_raw_rc, MSP_RAW_RC_FIELDS);
 
 /*
  * get
@@ -181,6 +237,17 @@ struct msp_raw_rc {
  */
 #define MSP_RAW_GPS             106
 
+#define MSP_RAW_GPS_FIELDS(_F, _S, _x)                          \
+    _F(_x, uint8_t,  fix,           , 0)                        \
+    _F(_x, uint8_t,  numsat,        , 0)                        \
+    _F(_x, int32_t,  lat,           , 0)                        \
+    _F(_x, int32_t,  lon,           , 0)                        \
+    _F(_x, uint16_t, altitude,      , 0)                        \
+    _F(_x, uint16_t, speed,         , 0)                        \
+    _F(_x, uint16_t, ground_course, , 1)
+
+MSP_MSG_STRUCT(msp_raw_gps, MSP_RAW_GPS_FIELDS);
+
 /*
  * get
  *      distance home
@@ -188,18 +255,26 @@ struct msp_raw_rc {
  */
 #define MSP_COMP_GPS            107
 
+#define MSP_COMP_GPS_FIELDS(_F, _S, _x)                         \
+    _F(_x, uint16_t, distance,  , 0)                            \
+    _F(_x, int16_t,  direction, , 0)                            \
+    _F(_x, uint8_t,  update,    , 1)
+
+MSP_MSG_STRUCT(msp_comp_gps, MSP_COMP_GPS_FIELDS);
+
 /*
  * get
  *      2 angles 1 heading
  */
 #define MSP_ATTITUDE            108
 
-struct msp_attitude {
-    int16_t roll;
-    int16_t pitch;
-    int16_t yaw;
-    int16_t yawtf;
-};
+#define MSP_ATTITUDE_FIELDS(_F, _S, _x)                         \
+    _F(_x, int16_t, roll,  , 0)                                 \
+    _F(_x, int16_t, pitch, , 0)                                 \
+    _F(_x, int16_t, yaw,   , 0)                                 \
+    _F(_x, int16_t, yawtf, , 0)
+
+MSP_MSG_STRUCT(msp_attitude, MSP_ATTITUDE_FIELDS);
 
 /*
  * get
@@ -208,10 +283,11 @@ struct msp_attitude {
  */
 #define MSP_ALTITUDE            109
 
-struct msp_altitude {
-    int32_t altitude;
-    int16_t variometer;
-};
+#define MSP_ALTITUDE_FIELDS(_F, _S, _x)                         \
+    _F(_x, int32_t, altitude,   , 0)                            \
+    _F(_x, int16_t, variometer, , 1)
+
+MSP_MSG_STRUCT(msp_altitude, MSP_ALTITUDE_FIELDS);
 
 /*
  * get
@@ -221,11 +297,12 @@ struct msp_altitude {
  */
 #define MSP_ANALOG              110
 
-struct msp_analog {
-    uint8_t vbat;
-    uint16_t powermetersum;
-    uint16_t rssi;
-} PACKED;
+#define MSP_ANALOG_FIELDS(_F, _S, _x)                           \
+    _F(_x, uint8_t,  vbat,          , 0)                        \
+    _F(_x, uint16_t, powermetersum, , 0)                        \
+    _F(_x, uint16_t, rssi,          , 1)
+
+MSP_MSG_STRUCT(msp_analog, MSP_ANALOG_FIELDS);
 
 /*
  * get
@@ -237,12 +314,37 @@ struct msp_analog {
  */
 #define MSP_RC_TUNING           111
 
+#define MSP_RC_TUNING_FIELDS(_F, _S, _x)                        \
+    _F(_x, uint8_t, rc_rate,        , 0)                        \
+    _F(_x, uint8_t, rc_expo,        , 0)                        \
+    _F(_x, uint8_t, rollpitch_rate, , 0)                        \
+    _F(_x, uint8_t, yaw_rate,       , 0)                        \
+    _F(_x, uint8_t, dynthr_pid,     , 0)                        \
+    _F(_x, uint8_t, thr_mid,        , 1)                        \
+    _F(_x, uint8_t, thr_expo,       , 1)
+
+MSP_MSG_STRUCT(msp_rc_tuning, MSP_RC_TUNING_FIELDS);
+
 /*
  * get
  *      P I D coeff (9 are used currently)
  */
 #define MSP_PID                 112
 
+#define MSP_N_PIDS        10
+
+#define MSP_PID_ITEM_FIELDS(_F, _S, _x)                         \
+    _F(_x, uint8_t, p, , 0)                                     \
+    _F(_x, uint8_t, i, , 0)                                     \
+    _F(_x, uint8_t, d, , 0)
+
+MSP_MSG_STRUCT(msp_pid_item, MSP_PID_ITEM_FIELDS);
+
+#define MSP_PID_FIELDS(_F, _S, _x)                              \
+    _S(_x, msp_pid_item, pid, [MSP_N_PIDS], 0)
+
+MSP_MSG_STRUCT(msp_pid, MSP_PID_FIELDS);
+
 /*
  * BOX setup (number is dependant of your setup)
  */
@@ -254,15 +356,32 @@ struct msp_analog {
  */
 #define MSP_MISC                114
 
+#define MSP_MISC_FIELDS(_F, _S, _x)                             \
+    _F(_x, uint16_t, powertrigger,      , 0)                    \
+    _F(_x, uint16_t, minthrottle,       , 1)                    \
+    _F(_x, uint16_t, maxthrottle,       , 1)                    \
+    _F(_x, uint16_t, mincommand,        , 1)                    \
+    _F(_x, uint16_t, failsafe_throttle, , 1)                    \
+    _F(_x, uint16_t, arm_cnt,           , 1)                    \
+    _F(_x, uint32_t, lifetime,          , 1)                    \
+    _F(_x, int16_t,  mag_declination,   , 1)                    \
+    _F(_x, uint8_t,  vbatscale,         , 1)                    \
+    _F(_x, uint8_t,  vbat_warn1,        , 1)                    \
+    _F(_x, uint8_t,  vbat_warn2,        , 1)                    \
+    _F(_x, uint8_t,  vbat_crit,         , 1)
+
+MSP_MSG_STRUCT(msp_misc, MSP_MISC_FIELDS);
+
 /*
  * get
  *   motor pins
  */
 #define MSP_MOTOR_PINS          115
 
-struct msp_motor_pins {
-    uint8_t pin[8];
-};
+#define MSP_MOTOR_PINS_FIELDS(_F, _S, _x)                       \
+    _F(_x, uint8_t, pin, [8], 0)
+
+MSP_MSG_STRUCT(msp_motor_pins, MSP_MOTOR_PINS_FIELDS);
 
 /*
  *
@@ -279,6 +398,20 @@ struct msp_motor_pins {
  */
 #define MSP_WP                  118		//out message		get a WP, WP# is in the payload, returns (WP#, lat, lon, alt, flags) WP#0-home, WP#16-poshold
 
+#define MSP_WP_REQ_FIELDS(_F, _S, _x)                           \
+    _F(_x, uint8_t, wp_no, , 0)
+
+MSP_MSG_STRUCT(msp_wp_req, MSP_WP_REQ_FIELDS);
+
+#define MSP_WP_FIELDS(_F, _S, _x)                               \
+    _F(_x, uint8_t, wp_no, , 0)                                 \
+    _F(_x, int32_t, lat,   , 0)                                 \
+    _F(_x, int32_t, lon,   , 0)                                 \
+    _F(_x, int32_t, alt,   , 0)                                 \
+    _F(_x, uint8_t, flags, , 0)
+
+MSP_MSG_STRUCT(msp_wp, MSP_WP_FIELDS);
+
 /*
  *
  */
@@ -289,6 +422,19 @@ struct msp_motor_pins {
  */
 #define MSP_SERVO_CONF          120		//out message		Servo settings
 
+#define MSP_SERVO_CONF_ITEM_FIELDS(_F, _S, _x)                  \
+    _F(_x, uint16_t, min,    , 0)                               \
+    _F(_x, uint16_t, max,    , 0)                               \
+    _F(_x, uint16_t, middle, , 0)                               \
+    _F(_x, uint8_t,  rate,   , 0)
+
+MSP_MSG_STRUCT(msp_servo_conf_item, MSP_SERVO_CONF_ITEM_FIELDS);
+
+#define MSP_SERVO_CONF_FIELDS(_F, _S, _x)                       \
+    _S(_x, msp_servo_conf_item, servo, [8], 0)
+
+MSP_MSG_STRUCT(msp_servo_conf, MSP_SERVO_CONF_FIELDS);
+
 
 /*
  * set
@@ -307,6 +453,16 @@ struct msp_motor_pins {
  */
 #define MSP_SET_RAW_GPS         201
 
+#define MSP_SET_RAW_GPS_FIELDS(_F, _S, _x)                      \
+    _F(_x, uint8_t,  fix,      , 0)                             \
+    _F(_x, uint8_t,  numsat,   , 0)                             \
+    _F(_x, int32_t,  lat,      , 0)                             \
+    _F(_x, int32_t,  lon,      , 0)                             \
+    _F(_x, uint16_t, altitude, , 0)                             \
+    _F(_x, uint16_t, speed,    , 0)
+
+MSP_MSG_STRUCT(msp_set_raw_gps, MSP_SET_RAW_GPS_FIELDS);
+
 /*
  * set
  *      P I D coeff (9 are used currently)
@@ -370,12 +526,22 @@ struct msp_motor_pins {
  */
 #define MSP_SELECT_SETTING      210
 
+#define MSP_SELECT_SETTING_FIELDS(_F, _S, _x)                   \
+    _F(_x, uint8_t, setting, , 0)
+
+MSP_MSG_STRUCT(msp_select_setting, MSP_SELECT_SETTING_FIELDS);
+
 /*
  * set
  *      heading hold direction
  */
 #define MSP_SET_HEAD            211
 
+#define MSP_SET_HEAD_FIELDS(_F, _S, _x)                         \
+    _F(_x, int16_t, heading, , 0)
+
+MSP_MSG_STRUCT(msp_set_head, MSP_SET_HEAD_FIELDS);
+
 /*
  * set
  *      servo settings
@@ -414,10 +580,28 @@ struct msp_motor_pins {
  */
 #define MSP_DEBUG               254
 
-int msp_msg_encode_req(const struct msp_hdr *hdr, void *data);
+#define MSP_DEBUG_FIELDS(_F, _S, _x)                            \
+    _F(_x, int16_t, debug, [4], 0)
+
+MSP_MSG_STRUCT(msp_debug, MSP_DEBUG_FIELDS);
+
+/*
+ * Write the wire format of request @args, hdr->len bytes, to
+ * @buf, leaving @args alone. Returns the frame checksum in @cks.
+ */
+int msp_msg_encode_req(const struct msp_hdr *hdr, const void *args,
+                       void *buf, uint8_t *cks);
 
 int msp_msg_decode_rsp(const struct msp_hdr *hdr, void *data);
 
+/*
+ * Header bytes of @hdr as sent, to @buf of MSP_HDR_MAX. '$' 'M'
+ * frames of MSP_JUMBO_LEN and over go out as jumbo frames.
+ */
+size_t msp_hdr_encode(const struct msp_hdr *hdr, void *buf);
+
+uint8_t msp_crc8_dvb_s2(uint8_t crc, const void *data, size_t len);
+
 uint8_t msp_msg_checksum(const struct msp_hdr *hdr, const void *data);
 
 const char * msp_cmd_name(msp_cmd_t cmd);
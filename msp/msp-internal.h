@@ -2,30 +2,237 @@
 #define MSP_MSP_INTERNAL_H
 
 #include <msp/msp.h>
+#include <msp/msg-internal.h>
+#include <msp/sub.h>
 
 #include <crt/tty.h>
 #include <crt/evtloop.h>
+#include <crt/timer.h>
 
-#define MSP_TAB_SIZE (MSP_CMD_MAX - MSP_CMD_MIN)
+#include <crt/list.h>
+
+#define MSP_TAB_SIZE (MSP_V1_CMD_MAX - MSP_CMD_MIN + 1)
 #define MSP_TAB_IDX(_cmd) (_cmd - MSP_CMD_MIN)
 
+/* adaptive timeouts, usecs */
+#define MSP_RTO_INIT         1000000
+#define MSP_RTO_MIN          20000
+#define MSP_RTO_MAX          1000000
+#define MSP_RTO_GRANULARITY  1000
+
+/*
+ * Known reads only query FC state, and are safe to resend by
+ * default. Writes and unknown commands are not.
+ */
+#define MSP_CMD_IDEMPOTENT(_cmd) (msp_msg_info(_cmd)->read)
+
+#define MSP_CQ_SIZE_MIN 64
+
+/*
+ * Batches up to this many requests track their calls on the
+ * stack, larger ones on the heap.
+ */
+#define MSP_BATCH_LOCAL 16
+
+/*
+ * Calls are recycled through a per-session pool. It starts out
+ * with enough for one command at full depth, and keeps up to
+ * MSP_CALL_POOL_MAX spare ones around.
+ */
+#define MSP_CALL_POOL_MIN MSP_DEPTH_MAX
+#define MSP_CALL_POOL_MAX (4 * MSP_DEPTH_MAX)
+
+#define MSP_RETRY_READ                          \
+    (struct msp_retry) {                        \
+        .cnt = 2,                               \
+        .backoff = { 0, 5000 },                 \
+        .jitter = 50,                           \
+    }
+
+struct msp_push {
+    msp_call_retfn fn;
+    void *priv;
+};
+
 struct msp_call {
+    struct msp *msp;
+    msp_cmd_t cmd;
     msp_call_retfn rfn;
     void *priv;
+    void *key;
+    void (*release)(void *priv);
+    struct timer timer;
+    struct timeval timeo;
+    int fixed;
+    struct timeval deadline;
+    struct timeval expires;
+    struct timeval sent;
+    size_t len;
+    void *frame;
+    void *fbuf;
+    size_t flen;
+    void *rsp;
+    size_t rsplen;
+    int tries;
+    int resend;
+    struct msp_call *leader;
+    struct list waiters;
+    enum msp_prio prio;
+    struct list txentry;
+    int inflight;
+    int cancel;
+    struct list entry;
+};
+
+/*
+ * Pending calls per command, oldest first. Responses are
+ * matched to calls in order. Slots of v2 commands past the
+ * table hold their push handler, and sit on a list.
+ */
+struct msp_slot {
+    msp_cmd_t cmd;
+    struct list calls;
+    int cnt;
+    int depth;
+    enum msp_prio prio;
+    struct hist *rtt;
+    unsigned long timeouts;
+    unsigned long wire;
+    unsigned long srtt;
+    unsigned long rttvar;
+    unsigned long rto;
+    struct msp_retry retry;
+    unsigned long retries;
+    struct timeval stale;
+    void *last;
+    msp_len_t lastlen;
+    struct timeval lastt;
+    struct msp_push push;
+    struct list entry;
+};
+
+struct msp_sub {
+    struct msp *msp;
+    msp_cmd_t cmd;
+    unsigned int hz;
+    int prio;
+    double grant;
+    struct timeval period;
+    struct timeval next;
+    struct timer *timer;
+    int busy;
+    struct msp_call *call;
+    msp_call_retfn fn;
+    void *priv;
+    struct timeval since;
+    unsigned long cnt;
+    double rate;
+    unsigned long missed;
+    unsigned long errors;
+    int delta;
+    struct msp_sub_field *fields;
+    int nfields;
+    struct timeval heartbeat;
+    uint8_t prev[MSP_LEN_MAX];
+    msp_len_t prevlen;
+    int have;
+    struct timeval delivered;
+    unsigned long dropped;
+    struct list entry;
+};
+
+struct msp_rc_stream {
+    struct msp *msp;
+    const struct msp_raw_rc *chn;
+    struct msp_raw_rc last;
+    struct timeval period;
+    struct timeval keepalive;
+    struct timeval sent;
     struct timer *timer;
+    int unacked;
+    unsigned long nsent;
+    unsigned long acked;
+    unsigned long lost;
+    unsigned long busy;
+    struct timeval ackt;
+    struct list entry;
+};
+
+struct msp_profile_key {
+    struct msp_ident ident;
+    uint16_t hwcaps;
+    uint8_t conf;
+} PACKED;
+
+struct msp_profile {
+    struct msp *msp;
+    char *path;
+    char *dev;
+    struct msp_profile_key key;
+    int pending;
+    int err;
 };
 
 struct msp {
     struct tty *tty;
     struct evtloop *loop;
-    struct msp_call *tab[MSP_TAB_SIZE];
+    struct msp_slot tab[MSP_TAB_SIZE];
+    struct list xslots;
+    enum msp_framing framing;
+    unsigned int framings; /* the FC takes, 1 << enum msp_framing */
+    size_t lenmax;
     struct iovec iov[2];
+    uint8_t rxhdr[MSP_HDR_MAX];
     struct msp_hdr hdr;
+    uint8_t rxsum;
     uint8_t cks;
+    uint8_t rxspare[MSP_LEN_MAX];
+    void *txbuf;
+    size_t txsize;
+    uint8_t *txpend;
+    size_t txpendlen;
+    size_t txpendsize;
+    struct list txq[MSP_PRIO_BULK + 1];
+    struct timer *txtimer;
+    size_t txcap;
+    struct msp_cqe *cq;
+    unsigned int cqsize;
+    unsigned int cqhead;
+    unsigned int cqcnt;
+    int wmax;
+    double cwnd;
+    double ssthresh;
+    int inflight;
+    struct list callpool;
+    int poolcnt;
+    struct list subs;
+    struct list streams;
+    int rcdepth;
+    struct msp_push push[MSP_V1_CMD_MAX + 1];
+    struct msp_push push_any;
+    unsigned long rto_min;
+    unsigned long rto_max;
 };
 
 struct msp_call *msp_call_get(struct msp *, msp_cmd_t);
 
+int msp_call_submit(struct msp *, const struct msp_req *,
+                    const struct timeval *, struct msp_call **);
+
+void msp_call_orphan(struct msp_call *);
+
+/* room for any frame */
+#define MSP_FRAME_MAX (MSP_HDR_MAX + MSP_LEN_MAX + 1)
+
+size_t msp_frame_size(struct msp *, msp_cmd_t, size_t len);
+
+/* time on the wire at the tty's baud rate */
+unsigned long msp_wire_usecs(struct msp *, size_t bytes);
+
+void msp_stash(struct msp *, const struct msp_hdr *, const void *);
+
+int msp_stash_get(struct msp *, msp_cmd_t, const void **, msp_len_t *);
+
 #endif
 
 /*
@@ -3,22 +3,146 @@
 #endif
 
 #include <msp/msp-internal.h>
+#include <msp/msg-internal.h>
 
 #include <msp/msg.h>
+#include <msp/sub.h>
+#include <msp/rcstream.h>
 #include <msp/str.h>
 #include <msp/defs.h>
 
 #include <crt/defs.h>
 #include <crt/log.h>
+#include <crt/hist.h>
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 static void msp_tty_return(struct msp *);
 
+static void msp_call_exit(struct msp *, struct msp_call *);
+static void msp_call_release(struct msp_call *);
+static void msp_call_free(struct msp_call *);
+static void __msp_call_timeo(const struct timeval *, void *);
+static void msp_tx_timeo(const struct timeval *, void *);
+static void msp_tx_drain(struct msp *);
+
+static enum msp_prio
+msp_cmd_prio(msp_cmd_t cmd)
+{
+    switch (cmd) {
+    case MSP_SET_RAW_RC:
+    case MSP_SET_RAW_GPS:
+    case MSP_SET_HEAD:
+    case MSP_SET_MOTOR:
+        return MSP_PRIO_CONTROL;
+
+    case MSP_EEPROM_WRITE:
+        return MSP_PRIO_BULK;
+    }
+
+    if (cmd >= MSP_RC_TUNING && cmd <= MSP_SERVO_CONF)
+        return MSP_PRIO_BULK;
+
+    if (cmd >= MSP_SET_PID && cmd <= MSP_SET_SERVO_CONF)
+        return MSP_PRIO_BULK;
+
+    return MSP_PRIO_TELEMETRY;
+}
+
+static unsigned long
+msp_rto_init(struct msp *msp)
+{
+    return min(max(MSP_RTO_INIT, msp->rto_min), msp->rto_max);
+}
+
+static void
+msp_slot_init(struct msp *msp, struct msp_slot *slot, msp_cmd_t cmd)
+{
+    list_init(&slot->calls);
+    slot->cmd = cmd;
+    slot->depth = 1;
+    slot->prio = msp_cmd_prio(cmd);
+    slot->rto = msp_rto_init(msp);
+
+    if (MSP_CMD_IDEMPOTENT(cmd))
+        slot->retry = MSP_RETRY_READ;
+
+    switch (cmd) {
+    case MSP_IDENT:
+    case MSP_BOX:
+    case MSP_BOXNAMES:
+    case MSP_PIDNAMES:
+    case MSP_BOXIDS:
+        slot->stale = MSP_STALE_FOREVER;
+        break;
+    }
+}
+
+static void
+msp_slot_exit(struct msp *msp, struct msp_slot *slot)
+{
+    struct msp_call *call, *next;
+
+    list_for_each_entry_safe(&slot->calls, call, next, entry) {
+        msp_call_release(call);
+        msp_call_exit(msp, call);
+    }
+
+    if (slot->rtt)
+        hist_destroy(slot->rtt);
+
+    if (slot->last)
+        free(slot->last);
+}
+
 void
 msp_close(struct msp *msp)
 {
+    struct msp_rc_stream *rcs, *nrcs;
+    struct msp_sub *sub, *nsub;
+    struct msp_call *call, *next;
+    struct msp_slot *slot, *nslot;
+    int i;
+
+    list_for_each_entry_safe(&msp->subs, sub, nsub, entry)
+        msp_unsubscribe(sub);
+
+    list_for_each_entry_safe(&msp->streams, rcs, nrcs, entry)
+        msp_rc_stream_close(rcs);
+
+    for (i = 0; i < MSP_TAB_SIZE; i++)
+        msp_slot_exit(msp, &msp->tab[i]);
+
+    list_for_each_entry_safe(&msp->xslots, slot, nslot, entry) {
+        msp_slot_exit(msp, slot);
+        free(slot);
+    }
+
+    if (msp->txtimer)
+        timer_destroy(msp->txtimer);
+
+    list_for_each_entry_safe(&msp->callpool, call, next, entry)
+        msp_call_free(call);
+
+    while (msp->cqcnt) {
+        struct msp_cqe cqe;
+
+        msp_reap(msp, &cqe, 1);
+        if (cqe.data)
+            free(cqe.data);
+    }
+
+    if (msp->cq)
+        free(msp->cq);
+
+    if (msp->txbuf)
+        free(msp->txbuf);
+
+    if (msp->txpend)
+        free(msp->txpend);
+
     free(msp);
 }
 
@@ -26,7 +150,7 @@ struct msp *
 msp_open(struct tty *tty, struct evtloop *loop)
 {
     struct msp *msp;
-    int rc;
+    int rc, i;
 
     rc = -1;
 
@@ -36,12 +160,47 @@ msp_open(struct tty *tty, struct evtloop *loop)
 
     msp->tty = tty;
     msp->loop = loop;
+    msp->subs = LIST(&msp->subs);
+    msp->streams = LIST(&msp->streams);
+    msp->callpool = LIST(&msp->callpool);
+    msp->xslots = LIST(&msp->xslots);
+    msp->rto_min = MSP_RTO_MIN;
+    msp->rto_max = MSP_RTO_MAX;
+    msp->framing = MSP_FRAMING_V0;
+    msp->framings = 1 << MSP_FRAMING_V0;
+    msp->lenmax = MSP_JUMBO_LEN - 1;
+    msp->txcap = msp_frame_size(msp, MSP_CMD_MIN, UINT8_MAX);
+
+    for (i = 0; i <= MSP_PRIO_BULK; i++)
+        list_init(&msp->txq[i]);
+
+    for (i = 0; i < MSP_TAB_SIZE; i++)
+        msp_slot_init(msp, &msp->tab[i], MSP_CMD_MIN + i);
+
+    msp->txtimer = __timer_create(msp_tx_timeo, msp);
+    if (!expected(msp->txtimer))
+        goto out;
+
+    for (i = 0; i < MSP_CALL_POOL_MIN; i++) {
+        struct msp_call *call;
+
+        call = calloc(1, sizeof(*call));
+        if (!expected(call))
+            goto out;
+
+        list_insert_tail(&msp->callpool, &call->entry);
+        msp->poolcnt++;
+
+        call->fbuf = malloc(MSP_FRAME_MAX);
+        if (!expected(call->fbuf))
+            goto out;
+    }
 
     msp_tty_return(msp);
 
     rc = 0;
 out:
-    if (rc) {
+    if (rc && msp) {
         int err = errno;
 
         msp_close(msp);
@@ -53,296 +212,1918 @@ out:
     return msp;
 }
 
-static struct msp_call **
-msp_call_entry(struct msp *msp, msp_cmd_t cmd)
+/*
+ * v1 commands have a slot each in the table. v2 commands past it
+ * get one on first use, and NULL until then.
+ */
+static struct msp_slot *
+msp_slot(struct msp *msp, msp_cmd_t cmd)
 {
+    struct msp_slot *slot;
+
     assert(cmd >= MSP_CMD_MIN);
-    assert(cmd <= MSP_CMD_MAX);
 
-    return &msp->tab[MSP_TAB_IDX(cmd)];
+    if (cmd <= MSP_V1_CMD_MAX)
+        return &msp->tab[MSP_TAB_IDX(cmd)];
+
+    list_for_each_entry(&msp->xslots, slot, entry)
+        if (slot->cmd == cmd)
+            return slot;
+
+    return NULL;
+}
+
+static struct msp_slot *
+msp_slot_add(struct msp *msp, msp_cmd_t cmd)
+{
+    struct msp_slot *slot;
+
+    slot = msp_slot(msp, cmd);
+    if (slot)
+        return slot;
+
+    slot = calloc(1, sizeof(*slot));
+    if (!expected(slot))
+        return NULL;
+
+    msp_slot_init(msp, slot, cmd);
+    list_insert_tail(&msp->xslots, &slot->entry);
+
+    return slot;
 }
 
 struct msp_call *
 msp_call_get(struct msp *msp, msp_cmd_t cmd)
 {
-    return *msp_call_entry(msp, cmd);
+    struct msp_slot *slot = msp_slot(msp, cmd);
+
+    if (!slot)
+        return NULL;
+
+    return list_first_entry(&slot->calls, struct msp_call, entry);
 }
 
-static void
-msp_call_set(struct msp *msp, msp_cmd_t cmd, struct msp_call *call)
+int
+msp_set_depth(struct msp *msp, msp_cmd_t cmd, int depth)
 {
-    *msp_call_entry(msp, cmd) = call;
+    struct msp_slot *slot;
+
+    if (cmd < MSP_CMD_MIN ||
+        depth < 1 || depth > MSP_DEPTH_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    slot = msp_slot_add(msp, cmd);
+    if (!slot)
+        return -1;
+
+    slot->depth = depth;
+
+    return 0;
 }
 
-static void
-msp_call_clr(struct msp *msp, msp_cmd_t cmd)
+int
+msp_set_prio(struct msp *msp, msp_cmd_t cmd, enum msp_prio prio)
 {
-    msp_call_set(msp, cmd, NULL);
+    struct msp_slot *slot;
+
+    if (cmd < MSP_CMD_MIN ||
+        prio < MSP_PRIO_DEFAULT || prio > MSP_PRIO_BULK) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    slot = msp_slot_add(msp, cmd);
+    if (!slot)
+        return -1;
+
+    slot->prio = prio ? prio : msp_cmd_prio(cmd);
+
+    return 0;
 }
 
-static void
-__msp_call_timeo(const struct timeval *timeo, void *data)
+void
+msp_set_txcap(struct msp *msp, size_t cap)
 {
-    struct msp_call **tab = data, *call = *tab;
+    msp->txcap = cap;
+}
+
+int
+msp_set_window(struct msp *msp, int max)
+{
+    if (max < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    msp->wmax = max;
+    msp->ssthresh = max;
+    msp->cwnd = min(max(msp->cwnd, 1), max);
 
-    call->rfn(ETIMEDOUT, NULL, NULL, call->priv);
+    msp_tx_drain(msp);
 
-    timer_destroy(call->timer);
-    call->timer = NULL;
+    return 0;
 }
 
-static void
-__msp_call_destroy(struct msp_call *call)
+int
+msp_window(struct msp *msp, int *inflight)
 {
-    if (call->timer)
-        timer_destroy(call->timer);
-    free(call);
+    if (inflight)
+        *inflight = msp->inflight;
+
+    return msp->wmax ? (int)msp->cwnd : 0;
 }
 
+/*
+ * AIMD, with slow start below the threshold.
+ */
 static void
-msp_call_exit(struct msp *msp, msp_cmd_t cmd)
+msp_window_grow(struct msp *msp)
 {
-    struct msp_call *call;
+    if (!msp->wmax)
+        return;
 
-    call = msp_call_get(msp, cmd);
-    if (call != NULL);
+    if (msp->cwnd < msp->ssthresh)
+        msp->cwnd += 1;
+    else
+        msp->cwnd += 1 / msp->cwnd;
 
-    msp_call_clr(msp, cmd);
+    msp->cwnd = min(msp->cwnd, msp->wmax);
+}
 
-    __msp_call_destroy(call);
+static void
+msp_window_shrink(struct msp *msp)
+{
+    if (!msp->wmax)
+        return;
+
+    msp->cwnd = max(msp->cwnd / 2, 1);
+    msp->ssthresh = msp->cwnd;
 }
 
-static struct msp_call *
-msp_call_init(struct msp *msp, msp_cmd_t cmd,
-              msp_call_retfn rfn, void *priv,
-              const struct timeval *timeo)
+void
+msp_set_rto(struct msp *msp,
+            const struct timeval *min, const struct timeval *max)
 {
-    struct msp_call *call;
-    struct timeval _timeo;
-    int rc;
+    struct msp_slot *slot;
+    int i;
 
-    call = msp_call_get(msp, cmd);
+    msp->rto_min = min->tv_sec * 1000000UL + min->tv_usec;
+    msp->rto_max = max->tv_sec * 1000000UL + max->tv_usec;
 
-    rc = unexpected(call) ? -1 : 0;
-    if (rc) {
-        errno = EBUSY;
-        goto out;
+    for (i = 0; i < MSP_TAB_SIZE; i++) {
+        slot = &msp->tab[i];
+
+        slot->rto = max(slot->rto, msp->rto_min);
+        slot->rto = min(slot->rto, msp->rto_max);
     }
 
-    call = calloc(1, sizeof(*call));
+    list_for_each_entry(&msp->xslots, slot, entry) {
+        slot->rto = max(slot->rto, msp->rto_min);
+        slot->rto = min(slot->rto, msp->rto_max);
+    }
+}
 
-    rc = expected(call) ? 0 : -1;
-    if (rc)
-        goto out;
+const struct timeval *
+msp_rto(struct msp *msp, msp_cmd_t cmd, struct timeval *tv)
+{
+    struct msp_slot *slot = msp_slot(msp, cmd);
+    unsigned long rto;
 
-    call->rfn = rfn;
-    call->priv = priv;
+    rto = slot ? slot->rto : msp_rto_init(msp);
 
-    gettimeofday(&_timeo, NULL);
-    timeradd(&_timeo, timeo, &_timeo);
+    tv->tv_sec = rto / 1000000;
+    tv->tv_usec = rto % 1000000;
 
-    call->timer = evtloop_create_timer(msp->loop, &_timeo,
-                                       __msp_call_timeo,
-                                       msp_call_entry(msp, cmd));
+    return tv;
+}
 
-    rc = expected(call->timer) ? 0 : -1;
-    if (rc)
-        goto out;
+/*
+ * RFC 6298 estimator, in usecs. Until the first sample, the RTO
+ * sits at its initial value.
+ */
+static void
+msp_rtt_sample(struct msp *msp, struct msp_slot *slot, unsigned long rtt)
+{
+    unsigned long rto;
 
-    msp_call_set(msp, cmd, call);
-out:
-    if (rc && call) {
-        __msp_call_destroy(call);
-        call = NULL;
+    if (!slot->srtt) {
+        slot->srtt = rtt;
+        slot->rttvar = rtt / 2;
+    } else {
+        long err = rtt - slot->srtt;
+
+        slot->rttvar += ((err < 0 ? -err : err) - (long)slot->rttvar) / 4;
+        slot->srtt += err / 8;
     }
 
-    return call;
+    rto = slot->srtt + max(4 * slot->rttvar, MSP_RTO_GRANULARITY);
+    rto = max(rto, msp->rto_min);
+    rto = min(rto, msp->rto_max);
+
+    slot->rto = rto;
 }
 
 static void
-msp_tty_recv_data(struct tty *tty, int err, void *priv)
+msp_call_free(struct msp_call *call)
 {
-    struct msp *msp;
-    const struct msp_hdr *hdr;
-    struct msp_call *call;
-    msp_call_retfn rfn;
-    void *data;
-    int rc;
-
-    msp = priv;
-    hdr = &msp->hdr;
+    if (call->fbuf)
+        free(call->fbuf);
+    free(call);
+}
 
-    data = NULL;
-    call = msp_call_get(msp, hdr->cmd);
+/*
+ * Back to the pool, frame buffer and all, unless it's full.
+ */
+static void
+__msp_call_destroy(struct msp_call *call)
+{
+    struct msp *msp = call->msp;
+    struct msp_call *waiter, *next;
 
-    rc = 0;
+    list_for_each_entry_safe(&call->waiters, waiter, next, entry)
+        __msp_call_destroy(waiter);
 
-    assert(call != NULL);
+    timer_stop(&call->timer);
 
-    if (hdr->len) {
-        data = msp->iov[0].iov_base;
+    if (msp->poolcnt >= MSP_CALL_POOL_MAX) {
+        msp_call_free(call);
+        return;
+    }
 
-        msp->cks ^= msp_msg_checksum(hdr, data);
+    list_insert_head(&msp->callpool, &call->entry);
+    msp->poolcnt++;
+}
 
-        rc = msp->cks ? -1 : 0;
-        if (rc) {
-            errno = unexpected(EBADMSG);
-            goto out;
-        }
+static void
+msp_call_unqueue(struct msp *msp, struct msp_call *call)
+{
+    list_remove_init(&call->entry);
+    list_remove_init(&call->txentry);
 
-        rc = msp_msg_decode_rsp(hdr, data);
+    if (call->inflight) {
+        call->inflight = 0;
+        msp->inflight--;
     }
 
-out:
-    rfn = call->rfn;
-    priv = call->priv;
+    if (!call->leader)
+        msp_slot(msp, call->cmd)->cnt--;
 
-    msp_call_exit(msp, hdr->cmd);
+    timer_stop(&call->timer);
+}
 
-    if (rc) {
-        hdr = NULL;
-        data = NULL;
-    }
+/*
+ * @call and its waiters go without calling back.
+ */
+static void
+msp_call_release(struct msp_call *call)
+{
+    struct msp_call *waiter;
 
-    rfn(rc ? errno : 0, hdr, data, priv);
+    list_for_each_entry(&call->waiters, waiter, entry)
+        msp_call_release(waiter);
 
-    msp_tty_return(msp);
+    if (call->release)
+        call->release(call->priv);
+    call->release = NULL;
 }
 
 static void
-msp_tty_recv_hdr(struct tty *tty, int err, void *priv)
+msp_call_exit(struct msp *msp, struct msp_call *call)
+{
+    msp_call_unqueue(msp, call);
+    __msp_call_destroy(call);
+}
+
+static struct msp_call *
+msp_call_alloc(struct msp *msp, msp_cmd_t cmd,
+               msp_call_retfn rfn, void *priv)
 {
-    struct msp *msp;
-    struct msp_hdr *hdr;
     struct msp_call *call;
-    int cnt;
+    void *fbuf = NULL;
+
+    call = list_first_entry(&msp->callpool, struct msp_call, entry);
+    if (call) {
+        list_remove(&call->entry);
+        msp->poolcnt--;
+
+        fbuf = call->fbuf;
+        memset(call, 0, sizeof(*call));
+    } else {
+        call = calloc(1, sizeof(*call));
+        if (!expected(call))
+            return NULL;
+    }
 
-    msp = priv;
-    hdr = &msp->hdr;
-    call = NULL;
+    timer_init(&call->timer, __msp_call_timeo, call);
+    call->fbuf = fbuf;
+    call->entry = LIST(&call->entry);
+    call->txentry = LIST(&call->txentry);
+    call->waiters = LIST(&call->waiters);
+    call->msp = msp;
+    call->cmd = cmd;
+    call->rfn = rfn;
+    call->priv = priv;
+    call->key = priv;
 
-    assert(msp->iov[0].iov_base == hdr);
-    assert(msp->iov[0].iov_len == sizeof(*hdr));
+    return call;
+}
 
-    if (unexpected(hdr->tag[0] != '$' || hdr->tag[1] != 'M'))
-        goto bad;
+static int
+msp_cq_grow(struct msp *msp)
+{
+    struct msp_cqe *cq;
+    unsigned int size, tail;
 
-    if (unexpected(hdr->dsc != '!' && hdr->dsc != '>'))
-        goto bad;
+    size = max(msp->cqsize * 2, MSP_CQ_SIZE_MIN);
 
-    call = msp_call_get(msp, hdr->cmd);
-    if (!expected(call))
-        goto bad;
+    cq = realloc(msp->cq, size * sizeof(*cq));
+    if (!expected(cq))
+        return -1;
 
-    cnt = 0;
+    /* unwrap, entries past the old end move up */
+    tail = msp->cqhead + msp->cqcnt;
+    if (tail > msp->cqsize)
+        memcpy(cq + msp->cqsize, cq, (tail - msp->cqsize) * sizeof(*cq));
 
-    if (hdr->len) {
-        struct iovec *iov = &msp->iov[0];
+    msp->cq = cq;
+    msp->cqsize = size;
 
-        *iov = (struct iovec) {
-            .iov_base = malloc(hdr->len),
-            .iov_len = hdr->len
-        };
+    return 0;
+}
 
-        if (!expected(iov->iov_base)) {
-            err = expected(errno);
-            goto out;
-        }
+static void
+msp_cq_post(struct msp *msp, void *tag,
+            int err, const struct msp_hdr *hdr, void *data)
+{
+    struct msp_cqe *cqe;
+    int rc;
 
-        cnt = 1;
+    if (msp->cqcnt == msp->cqsize) {
+        rc = msp_cq_grow(msp);
+        if (rc) {
+            if (data)
+                free(data);
+            return;
+        }
     }
 
-    msp->iov[cnt++] = (struct iovec) {
-        &msp->cks,
-        sizeof(msp->cks)
-    };
-
-    tty_setrxbuf(msp->tty, msp->iov, cnt, msp_tty_recv_data, msp);
-
-    return;
+    cqe = &msp->cq[(msp->cqhead + msp->cqcnt) % msp->cqsize];
+    msp->cqcnt++;
 
-bad:
-    err = EBADMSG;
+    *cqe = (struct msp_cqe) {
+        .tag = tag,
+        .err = err,
+        .data = data,
+    };
 
-    error("%s cmd %d hdr %c%c%c len %u\n",
-          msp_cmd_name(hdr->cmd), hdr->cmd,
-          hdr->tag[0], hdr->tag[1], hdr->dsc,
-          hdr->len);
-out:
-    tty_rxflush(tty);
+    if (hdr)
+        cqe->hdr = *hdr;
 }
 
 static void
-msp_tty_return(struct msp *msp)
+msp_call_ret(struct msp *msp, msp_call_retfn rfn, void *priv,
+             int err, const struct msp_hdr *hdr, void *data)
 {
-    msp->iov[0] = (struct iovec) {
-        .iov_base = &msp->hdr,
-        .iov_len = sizeof(msp->hdr),
-    };
-
-    tty_setrxbuf(msp->tty, msp->iov, 1, msp_tty_recv_hdr, msp);
+    if (rfn)
+        rfn(err, hdr, data, priv);
+    else
+        msp_cq_post(msp, priv, err, hdr, data);
 }
 
 int
-msp_call(struct msp *msp,
-         msp_cmd_t cmd, void *args, size_t len,
-         msp_call_retfn rfn, void *priv, const struct timeval *timeo)
+msp_reap(struct msp *msp, struct msp_cqe *cqes, int n)
 {
-    struct msp_hdr hdr;
-    struct iovec iov[3];
-    struct msp_call *call;
-    uint8_t cks;
-    int rc, cnt;
+    int i;
 
-    cnt = 0;
-    hdr = MSP_REQ_HDR(cmd, len);
+    for (i = 0; i < n && msp->cqcnt; i++) {
+        cqes[i] = msp->cq[msp->cqhead];
 
-    call = msp_call_init(msp, cmd, rfn, priv, timeo);
-
-    rc = expected(call) ? 0 : -1;
-    if (rc)
-        goto out;
+        msp->cqhead = (msp->cqhead + 1) % msp->cqsize;
+        msp->cqcnt--;
+    }
 
-    iov[cnt++] = (struct iovec) {
-        .iov_base = &hdr,
-        .iov_len = sizeof(hdr)
-    };
+    return i;
+}
 
-    if (len) {
-        rc = msp_msg_encode_req(&hdr, args);
-        if (unexpected(rc))
-            goto out;
+/*
+ * Complete @call and the waiters attached to it. Each waiter
+ * gets a copy of the response, the call itself gets @data.
+ */
+static void
+msp_call_complete(struct msp *msp, struct msp_call *call,
+                  int err, const struct msp_hdr *hdr, void *data)
+{
+    struct msp_call *waiter;
+    msp_call_retfn rfn;
+    void *priv;
 
-        iov[cnt++] = (struct iovec) {
-            .iov_base = args,
-            .iov_len = len,
-        };
-    }
+    msp_call_unqueue(msp, call);
 
-    cks = msp_msg_checksum(&hdr, args);
+    msp_tx_drain(msp);
 
-    iov[cnt++] = (struct iovec) {
-        .iov_base = &cks,
-        .iov_len = sizeof(cks)
-    };
+    while ((waiter = list_first_entry(&call->waiters,
+                                      struct msp_call, entry))) {
+        void *copy;
+        int _err;
 
-    rc = tty_sendv(msp->tty, iov, cnt);
-out:
-    if (rc) {
-        int err = errno;
+        _err = err;
+        copy = NULL;
 
-        if (call) {
-            msp_call_exit(msp, cmd);
-            call = NULL;
+        if (data) {
+            copy = malloc(hdr->len);
+            if (expected(copy))
+                memcpy(copy, data, hdr->len);
+            else
+                _err = errno;
         }
 
-        errno = err;
+        list_remove(&waiter->entry);
+
+        msp_call_ret(msp, waiter->rfn, waiter->priv,
+                     _err, _err ? NULL : hdr, copy);
+
+        __msp_call_destroy(waiter);
     }
 
-    return rc;
+    rfn = call->rfn;
+    priv = call->priv;
+
+    __msp_call_destroy(call);
+
+    msp_call_ret(msp, rfn, priv, err, hdr, data);
 }
 
-void
+static void
+msp_call_discard(int err,
+                 const struct msp_hdr *hdr, void *data, void *priv)
+{
+    if (data)
+        free(data);
+}
+
+/*
+ * Detach a call from its owner. The call stays queued, so the
+ * response still lines up with its request, but is dropped.
+ */
+void
+msp_call_orphan(struct msp_call *call)
+{
+    if (call->release)
+        call->release(call->priv);
+    call->release = NULL;
+
+    call->rfn = msp_call_discard;
+    call->priv = NULL;
+    call->rsp = NULL;
+}
+
+static int
+msp_call_coalesce(struct msp *msp, const struct msp_req *req)
+{
+    return !req->len && MSP_CMD_IDEMPOTENT(req->cmd);
+}
+
+void
+msp_set_stale(struct msp *msp, msp_cmd_t cmd, const struct timeval *stale)
+{
+    struct msp_slot *slot = msp_slot_add(msp, cmd);
+
+    if (!slot)
+        return;
+
+    slot->stale = *stale;
+
+    if (!timerisset(stale) && slot->last) {
+        free(slot->last);
+        slot->last = NULL;
+        timerclear(&slot->lastt);
+    }
+}
+
+void
+msp_stash(struct msp *msp, const struct msp_hdr *hdr, const void *data)
+{
+    struct msp_slot *slot = msp_slot(msp, hdr->cmd);
+    void *last;
+
+    if (!slot || !timerisset(&slot->stale))
+        return;
+
+    last = realloc(slot->last, max(hdr->len, 1));
+    if (!expected(last))
+        return;
+
+    memcpy(last, data, hdr->len);
+
+    slot->last = last;
+    slot->lastlen = hdr->len;
+    gettimeofday(&slot->lastt, NULL);
+}
+
+static int
+msp_stash_valid(struct msp *msp, const struct msp_req *req,
+                const struct timeval *now)
+{
+    struct msp_slot *slot = msp_slot(msp, req->cmd);
+    struct timeval end;
+
+    if (!timerisset(&slot->lastt) || !msp_call_coalesce(msp, req))
+        return 0;
+
+    if (slot->stale.tv_sec < 0)
+        return 1;
+
+    timeradd(&slot->lastt, &slot->stale, &end);
+
+    return timercmp(now, &end, <);
+}
+
+/*
+ * The cached response to @cmd, fresh or not, as long as no write
+ * dropped it.
+ */
+int
+msp_stash_get(struct msp *msp, msp_cmd_t cmd,
+              const void **data, msp_len_t *len)
+{
+    struct msp_slot *slot = msp_slot(msp, cmd);
+
+    if (!slot || !timerisset(&slot->lastt)) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    *data = slot->last;
+    *len = slot->lastlen;
+    return 0;
+}
+
+/*
+ * Forget what a known write on @cmd may have changed, as msg.c
+ * has it. Commands msg.c doesn't know drop nothing. The buffer
+ * stays, a batch may still be about to return it from an earlier
+ * read.
+ */
+static void
+msp_stash_drop(struct msp *msp, msp_cmd_t cmd)
+{
+    const struct msp_msg_info *info = msp_msg_info(cmd);
+    struct msp_slot *slot;
+    int i;
+
+    if (!info->sup || info->read || !info->drops)
+        return;
+
+    if (info->drops != MSP_MSG_DROPS_ALL) {
+        timerclear(&msp_slot(msp, info->drops)->lastt);
+        return;
+    }
+
+    for (i = 0; i < MSP_TAB_SIZE; i++)
+        timerclear(&msp->tab[i].lastt);
+
+    list_for_each_entry(&msp->xslots, slot, entry)
+        timerclear(&slot->lastt);
+}
+
+static void
+msp_stash_return(struct msp *msp, const struct msp_req *req)
+{
+    struct msp_slot *slot = msp_slot(msp, req->cmd);
+    struct msp_hdr hdr;
+    void *data;
+
+    hdr = (struct msp_hdr) {
+        .tag = { '$', 'M' },
+        .dsc = '>',
+        .len = slot->lastlen,
+        .cmd = req->cmd,
+    };
+
+    data = NULL;
+    if (hdr.len) {
+        data = malloc(hdr.len);
+        if (!expected(data)) {
+            msp_call_ret(msp, req->rfn, req->priv, errno, NULL, NULL);
+            return;
+        }
+
+        memcpy(data, slot->last, hdr.len);
+    }
+
+    msp_call_ret(msp, req->rfn, req->priv, 0, &hdr, data);
+}
+
+void
+msp_set_retry(struct msp *msp, msp_cmd_t cmd,
+              const struct msp_retry *retry)
+{
+    struct msp_slot *slot = msp_slot_add(msp, cmd);
+
+    if (slot)
+        slot->retry = *retry;
+}
+
+static int
+msp_call_expired(const struct msp_call *call, const struct timeval *now)
+{
+    return timerisset(&call->deadline) &&
+        !timercmp(now, &call->deadline, <);
+}
+
+/*
+ * The timer fires after @delay, or at the deadline if sooner.
+ */
+static void
+msp_call_arm(struct msp *msp, struct msp_call *call,
+             const struct timeval *delay)
+{
+    struct timeval timeo;
+
+    gettimeofday(&timeo, NULL);
+    timeradd(&timeo, delay, &call->expires);
+
+    timeo = call->expires;
+    if (timerisset(&call->deadline) &&
+        timercmp(&call->deadline, &timeo, <))
+        timeo = call->deadline;
+
+    evtloop_add_timer(msp->loop, &call->timer, &timeo);
+}
+
+/*
+ * Complete @call with @err ahead of its response. A call with
+ * nothing on the wire, nor anyone riding along, just leaves.
+ * Otherwise it stays queued, orphaned, until the response or
+ * its timeout, so responses keep lining up with calls.
+ */
+static void
+msp_call_abort(struct msp *msp, struct msp_call *call, int err)
+{
+    msp_call_retfn rfn = call->rfn;
+    void *priv = call->priv;
+
+    /* it calls back, nothing to release */
+    call->release = NULL;
+
+    if (call->leader) {
+        list_remove(&call->entry);
+        __msp_call_destroy(call);
+        goto out;
+    }
+
+    if (list_is_empty(&call->waiters) &&
+        (call->resend || !list_is_empty(&call->txentry))) {
+        msp_call_complete(msp, call, err, NULL, NULL);
+        return;
+    }
+
+    msp_call_orphan(call);
+    timerclear(&call->deadline);
+
+    if (list_is_empty(&call->waiters))
+        call->frame = NULL;
+
+    if (list_is_empty(&call->txentry))
+        evtloop_add_timer(msp->loop, &call->timer, &call->expires);
+    else
+        timer_stop(&call->timer);
+out:
+    msp_call_ret(msp, rfn, priv, err, NULL, NULL);
+}
+
+static struct msp_call *
+msp_call_marked(struct msp_slot *slot)
+{
+    struct msp_call *call, *waiter;
+
+    list_for_each_entry(&slot->calls, call, entry) {
+        list_for_each_entry(&call->waiters, waiter, entry)
+            if (waiter->cancel)
+                return waiter;
+
+        if (call->cancel)
+            return call;
+    }
+
+    return NULL;
+}
+
+/*
+ * Aborting a call runs callbacks and tx, which may complete,
+ * free or submit any call on the slot. So mark the victims
+ * first, then abort them one by one, looking each up afresh.
+ */
+int
+msp_call_cancel(struct msp *msp, msp_cmd_t cmd, void *priv)
+{
+    struct msp_call *call, *waiter;
+    struct msp_slot *slot;
+    int n;
+
+    if (cmd < MSP_CMD_MIN) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    slot = msp_slot(msp, cmd);
+    if (!slot)
+        return 0;
+
+    list_for_each_entry(&slot->calls, call, entry) {
+        list_for_each_entry(&call->waiters, waiter, entry)
+            if (waiter->key == priv)
+                waiter->cancel = 1;
+
+        if (call->rfn != msp_call_discard && call->key == priv)
+            call->cancel = 1;
+    }
+
+    n = 0;
+    while ((call = msp_call_marked(slot))) {
+        call->cancel = 0;
+        msp_call_abort(msp, call, ECANCELED);
+        n++;
+    }
+
+    return n;
+}
+
+/*
+ * A resend goes to the head of its class queue, and is scheduled
+ * like any other frame. The lost one no longer counts towards the
+ * window.
+ */
+static void
+msp_call_resend(struct msp *msp, struct msp_call *call)
+{
+    struct msp_slot *slot;
+
+    slot = msp_slot(msp, call->cmd);
+
+    call->resend = 0;
+    call->tries++;
+    slot->retries++;
+
+    if (call->inflight) {
+        call->inflight = 0;
+        msp->inflight--;
+    }
+
+    timer_stop(&call->timer);
+    if (timerisset(&call->deadline))
+        evtloop_add_timer(msp->loop, &call->timer, &call->deadline);
+
+    list_insert_head(&msp->txq[call->prio], &call->txentry);
+
+    msp_tx_drain(msp);
+}
+
+/*
+ * The call's frame is on the wire, its timeout starts now. The
+ * latency recorded runs from the first try.
+ */
+static void
+msp_call_sent(struct msp *msp, struct msp_call *call,
+              const struct timeval *now)
+{
+    struct timeval rto;
+
+    if (!call->tries)
+        call->sent = *now;
+
+    msp_call_arm(msp, call,
+                 call->fixed ? &call->timeo : msp_rto(msp, call->cmd, &rto));
+}
+
+/*
+ * Wait out the backoff, if any, before resending. The delay
+ * doubles with every try, and is spread by +/- jitter percent.
+ */
+static void
+msp_call_retry(struct msp *msp, struct msp_call *call)
+{
+    const struct msp_retry *retry;
+    struct timeval delay;
+    double usecs;
+
+    retry = &msp_slot(msp, call->cmd)->retry;
+
+    usecs = retry->backoff.tv_sec * 1000000.0 + retry->backoff.tv_usec;
+    usecs *= 1 << call->tries;
+    usecs += usecs * retry->jitter / 100 *
+        (2.0 * random() / RAND_MAX - 1);
+
+    if (usecs < 1) {
+        msp_call_resend(msp, call);
+        return;
+    }
+
+    delay.tv_sec = usecs / 1000000;
+    delay.tv_usec = usecs - delay.tv_sec * 1000000.0;
+
+    call->resend = 1;
+    msp_call_arm(msp, call, &delay);
+}
+
+/*
+ * Calls time out individually. Responses carry no sequence
+ * number, so a late response to an expired call will complete
+ * the next one queued for the same command. Likewise, a retried
+ * call is completed by whichever response comes first.
+ */
+static void
+__msp_call_timeo(const struct timeval *timeo, void *data)
+{
+    struct msp_call *call = data;
+    struct msp *msp = call->msp;
+    struct msp_slot *slot;
+
+    slot = msp_slot(msp, call->cmd);
+
+    if (msp_call_expired(call, timeo)) {
+        msp_call_abort(msp, call, ETIMEDOUT);
+        return;
+    }
+
+    if (call->resend) {
+        msp_call_resend(msp, call);
+        return;
+    }
+
+    slot->timeouts++;
+
+    /* back off, until the next sample resets it */
+    slot->rto = min(slot->rto * 2, msp->rto_max);
+
+    msp_window_shrink(msp);
+
+    if (call->frame && call->tries < slot->retry.cnt) {
+        msp_call_retry(msp, call);
+        return;
+    }
+
+    msp_call_complete(msp, call, ETIMEDOUT, NULL, NULL);
+}
+
+/*
+ * A new call goes to the back of the command's queue. If the
+ * queue is full, a read without arguments rides along with the
+ * newest call instead, as a waiter on its response.
+ */
+static struct msp_call *
+msp_call_init(struct msp *msp, const struct msp_req *req,
+              const struct timeval *timeo)
+{
+    struct msp_slot *slot;
+    struct msp_call *call;
+    int rc;
+
+    slot = msp_slot(msp, req->cmd);
+
+    call = msp_call_alloc(msp, req->cmd, req->rfn, req->priv);
+    if (!call)
+        return NULL;
+
+    if (req->release) {
+        call->key = req->key;
+        call->release = req->release;
+    }
+
+    if (slot->cnt >= slot->depth) {
+        struct msp_call *leader;
+
+        leader = list_last_entry(&slot->calls, struct msp_call, entry);
+
+        rc = msp_call_coalesce(msp, req) ? 0 : -1;
+        if (rc) {
+            errno = EBUSY;
+            goto out;
+        }
+
+        call->leader = leader;
+        list_insert_tail(&leader->waiters, &call->entry);
+        goto out;
+    }
+
+    if (timeo) {
+        call->timeo = *timeo;
+        call->fixed = 1;
+    }
+
+    call->deadline = req->deadline;
+    call->rsp = req->rsp;
+    call->rsplen = req->rsplen;
+
+    list_insert_tail(&slot->calls, &call->entry);
+    slot->cnt++;
+    rc = 0;
+out:
+    if (rc) {
+        __msp_call_destroy(call);
+        call = NULL;
+    }
+
+    return call;
+}
+
+unsigned long
+msp_wire_usecs(struct msp *msp, size_t bytes)
+{
+    int baud = tty_baud(msp->tty);
+
+    return baud > 0 ? bytes * 10 * 1000000UL / baud : 0;
+}
+
+static void
+msp_call_account(struct msp *msp, struct msp_call *call,
+                 const struct msp_hdr *hdr)
+{
+    struct msp_slot *slot;
+    struct timeval now, rtt;
+    unsigned long usecs;
+
+    slot = msp_slot(msp, call->cmd);
+
+    gettimeofday(&now, NULL);
+    timersub(&now, &call->sent, &rtt);
+
+    if (!slot->rtt)
+        slot->rtt = hist_create();
+
+    usecs = rtt.tv_sec * 1000000UL + rtt.tv_usec;
+    if (slot->rtt)
+        hist_record(slot->rtt, min(usecs, UINT32_MAX));
+
+    /* Karn: a response to a resent call is ambiguous */
+    if (!call->tries)
+        msp_rtt_sample(msp, slot, usecs);
+
+    msp_window_grow(msp);
+
+    slot->wire = msp_wire_usecs(msp,
+                                msp_frame_size(msp, call->cmd, call->len) +
+                                msp_frame_size(msp, call->cmd, hdr->len));
+}
+
+int
+msp_stat(struct msp *msp, msp_cmd_t cmd, struct msp_stat *st)
+{
+    struct msp_slot *slot;
+
+    if (cmd < MSP_CMD_MIN) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    slot = msp_slot(msp, cmd);
+    if (!slot) {
+        *st = (struct msp_stat) { .rto = msp_rto_init(msp) };
+        return 0;
+    }
+
+    *st = (struct msp_stat) {
+        .timeouts = slot->timeouts,
+        .wire = slot->wire,
+        .srtt = slot->srtt,
+        .rto = slot->rto,
+        .retries = slot->retries,
+    };
+
+    if (slot->rtt) {
+        st->cnt = hist_count(slot->rtt);
+        st->p50 = hist_percentile(slot->rtt, 50);
+        st->p99 = hist_percentile(slot->rtt, 99);
+        st->p999 = hist_percentile(slot->rtt, 99.9);
+        st->max = hist_max(slot->rtt);
+    }
+
+    return 0;
+}
+
+msp_cmd_t
+msp_stat_next(struct msp *msp, msp_cmd_t cmd)
+{
+    struct msp_slot *slot;
+    msp_cmd_t next;
+
+    if (cmd < MSP_CMD_MIN)
+        return MSP_CMD_MIN;
+
+    if (cmd < MSP_V1_CMD_MAX)
+        return cmd + 1;
+
+    next = 0;
+    list_for_each_entry(&msp->xslots, slot, entry)
+        if (slot->cmd > cmd && (!next || slot->cmd < next))
+            next = slot->cmd;
+
+    return next;
+}
+
+void
+msp_set_push_handler(struct msp *msp, msp_cmd_t cmd,
+                     msp_call_retfn fn, void *priv)
+{
+    struct msp_slot *slot;
+
+    if (cmd <= MSP_V1_CMD_MAX) {
+        msp->push[cmd] = (struct msp_push) { fn, priv };
+        return;
+    }
+
+    slot = fn ? msp_slot_add(msp, cmd) : msp_slot(msp, cmd);
+    if (slot)
+        slot->push = (struct msp_push) { fn, priv };
+}
+
+void
+msp_set_push_default(struct msp *msp, msp_call_retfn fn, void *priv)
+{
+    msp->push_any = (struct msp_push) { fn, priv };
+}
+
+static void
+msp_recv_push(struct msp *msp, const struct msp_hdr *hdr, void *data)
+{
+    const struct msp_push *push;
+    struct msp_slot *slot;
+    int rc;
+
+    if (hdr->cmd <= MSP_V1_CMD_MAX)
+        push = &msp->push[hdr->cmd];
+    else {
+        slot = msp_slot(msp, hdr->cmd);
+        push = slot ? &slot->push : &msp->push_any;
+    }
+
+    if (!push->fn)
+        push = &msp->push_any;
+
+    if (!push->fn) {
+        debug("dropping %s cmd %d len %u\n",
+              msp_cmd_name(hdr->cmd) ? : "?", hdr->cmd, hdr->len);
+        goto drop;
+    }
+
+    if (hdr->len && msp_msg_info(hdr->cmd)->sup) {
+        rc = msp_msg_decode_rsp(hdr, data);
+        if (rc)
+            goto drop;
+    }
+
+    push->fn(0, hdr, data, push->priv);
+    return;
+
+drop:
+    if (data)
+        free(data);
+}
+
+static void
+msp_tty_recv_data(struct tty *tty, int err, void *priv)
+{
+    struct msp *msp;
+    const struct msp_hdr *hdr;
+    struct msp_call *call;
+    uint8_t cks;
+    void *data;
+    int rc, own;
+
+    msp = priv;
+    hdr = &msp->hdr;
+
+    data = hdr->len ? msp->iov[0].iov_base : NULL;
+
+    /* unless read into rxspare, data was malloc'd */
+    own = data && data != msp->rxspare;
+
+    if (unexpected(err)) {
+        tty_rxflush(tty);
+        goto drop;
+    }
+
+    cks = msp_msg_sum(hdr->tag[1], msp->rxsum, data, hdr->len);
+
+    if (unexpected(cks != msp->cks)) {
+        error("%s cmd %d len %u: bad checksum\n",
+              msp_cmd_name(hdr->cmd) ? : "?", hdr->cmd, hdr->len);
+        goto drop;
+    }
+
+    call = hdr->cmd >= MSP_CMD_MIN ? msp_call_get(msp, hdr->cmd) : NULL;
+
+    /* only a good frame reaches the caller's buffer */
+    if (data == msp->rxspare) {
+        if (call && call->rsp && hdr->len <= call->rsplen)
+            data = call->rsp;
+        else {
+            data = malloc(hdr->len);
+            if (!expected(data))
+                goto out;
+            own = 1;
+        }
+
+        memcpy(data, msp->rxspare, hdr->len);
+    }
+
+    if (!call) {
+        msp_recv_push(msp, hdr, data);
+        goto out;
+    }
+
+    rc = hdr->len ? msp_msg_decode_rsp(hdr, data) : 0;
+
+    msp_call_account(msp, call, hdr);
+
+    if (rc) {
+        err = errno;
+
+        if (own)
+            free(data);
+
+        hdr = NULL;
+        data = NULL;
+    } else {
+        msp_stash_drop(msp, hdr->cmd);
+        msp_stash(msp, hdr, data);
+    }
+
+    msp_call_complete(msp, call, rc ? err : 0, hdr, data);
+out:
+    msp_tty_return(msp);
+    return;
+
+drop:
+    if (own)
+        free(data);
+
+    msp_window_shrink(msp);
+
+    msp_tty_return(msp);
+}
+
+/*
+ * A length of MSP_JUMBO_LEN marks a jumbo frame, but in v0, a
+ * frame may well carry that many bytes.
+ */
+static int
+msp_rx_jumbo(struct msp *msp)
+{
+    return msp->rxhdr[1] == 'M' &&
+        msp->rxhdr[3] == MSP_JUMBO_LEN &&
+        msp->framing != MSP_FRAMING_V0;
+}
+
+/*
+ * Decode the header in rxhdr and read the payload. Frames are
+ * read in full whether a call is waiting or not, v2 frames on
+ * commands past MSP_V1_CMD_MAX included. Only a malformed header
+ * makes us lose sync and flush.
+ */
+static void
+msp_rx_frame(struct msp *msp)
+{
+    const uint8_t *head;
+    struct msp_hdr *hdr;
+    size_t hlen;
+    int err, cnt;
+
+    head = msp->rxhdr;
+    hdr = &msp->hdr;
+
+    hdr->tag[0] = head[0];
+    hdr->tag[1] = head[1];
+    hdr->dsc = head[2];
+
+    if (head[1] == 'X') {
+        hdr->cmd = head[4] | head[5] << 8;
+        hdr->len = head[6] | head[7] << 8;
+        hlen = MSP_HDR_MAX;
+    } else if (msp_rx_jumbo(msp)) {
+        hdr->cmd = head[4];
+        hdr->len = head[5] | head[6] << 8;
+        hlen = MSP_HDR_MIN + sizeof(uint16_t);
+    } else {
+        hdr->cmd = head[4];
+        hdr->len = head[3];
+        hlen = MSP_HDR_MIN;
+    }
+
+    if (unexpected(hdr->len > MSP_LEN_MAX)) {
+        err = EMSGSIZE;
+        goto bad;
+    }
+
+    msp->rxsum = msp_msg_sum(head[1], 0, head + 3, hlen - 3);
+
+    cnt = 0;
+
+    if (hdr->len) {
+        struct iovec *iov = &msp->iov[0];
+        struct msp_call *call;
+        void *buf;
+
+        call = hdr->cmd >= MSP_CMD_MIN ?
+            msp_call_get(msp, hdr->cmd) : NULL;
+
+        if (call && call->rsp && hdr->len <= call->rsplen)
+            buf = msp->rxspare;
+        else {
+            buf = malloc(hdr->len);
+            if (!expected(buf)) {
+                err = expected(errno);
+                goto out;
+            }
+        }
+
+        *iov = (struct iovec) {
+            .iov_base = buf,
+            .iov_len = hdr->len
+        };
+
+        cnt = 1;
+    }
+
+    msp->iov[cnt++] = (struct iovec) {
+        &msp->cks,
+        sizeof(msp->cks)
+    };
+
+    tty_setrxbuf(msp->tty, msp->iov, cnt, msp_tty_recv_data, msp);
+
+    return;
+
+bad:
+    error("cmd %u hdr %c%c%c len %u: %s\n",
+          hdr->cmd, hdr->tag[0], hdr->tag[1], hdr->dsc,
+          hdr->len, strerror(err));
+out:
+    tty_rxflush(msp->tty);
+    msp_tty_return(msp);
+}
+
+static void
+msp_tty_recv_ext(struct tty *tty, int err, void *priv)
+{
+    struct msp *msp = priv;
+
+    if (unexpected(err)) {
+        tty_rxflush(tty);
+        msp_tty_return(msp);
+        return;
+    }
+
+    msp_rx_frame(msp);
+}
+
+/*
+ * The fixed part of the header: '$', the tag, the direction and
+ * two bytes which are the length and command of v0 frames. Jumbo
+ * and v2 frames take the rest of their header after it.
+ */
+static void
+msp_tty_recv_hdr(struct tty *tty, int err, void *priv)
+{
+    struct msp *msp;
+    uint8_t *head;
+    size_t more;
+
+    msp = priv;
+    head = msp->rxhdr;
+
+    assert(msp->iov[0].iov_base == head);
+    assert(msp->iov[0].iov_len == MSP_HDR_MIN);
+
+    if (unexpected(err))
+        goto out;
+
+    if (unexpected(head[0] != '$' || (head[1] != 'M' && head[1] != 'X')))
+        goto bad;
+
+    if (unexpected(head[2] != '!' && head[2] != '>'))
+        goto bad;
+
+    more = 0;
+
+    if (head[1] == 'X')
+        more = MSP_HDR_MAX - MSP_HDR_MIN;
+    else if (msp_rx_jumbo(msp))
+        more = sizeof(uint16_t);
+
+    if (more) {
+        msp->iov[0] = (struct iovec) {
+            .iov_base = head + MSP_HDR_MIN,
+            .iov_len = more,
+        };
+
+        tty_setrxbuf(tty, msp->iov, 1, msp_tty_recv_ext, msp);
+        return;
+    }
+
+    msp_rx_frame(msp);
+
+    return;
+
+bad:
+    error("hdr %c%c%c %02x %02x\n",
+          head[0], head[1], head[2], head[3], head[4]);
+out:
+    tty_rxflush(tty);
+    msp_tty_return(msp);
+}
+
+static void
+msp_tty_return(struct msp *msp)
+{
+    msp->iov[0] = (struct iovec) {
+        .iov_base = msp->rxhdr,
+        .iov_len = MSP_HDR_MIN,
+    };
+
+    tty_setrxbuf(msp->tty, msp->iov, 1, msp_tty_recv_hdr, msp);
+}
+
+static int
+msp_txbuf_reserve(struct msp *msp, size_t size)
+{
+    void *buf;
+
+    if (size <= msp->txsize)
+        return 0;
+
+    buf = realloc(msp->txbuf, size);
+    if (!expected(buf))
+        return -1;
+
+    msp->txbuf = buf;
+    msp->txsize = size;
+
+    return 0;
+}
+
+/*
+ * The frame tag for requests on @cmd: '$' 'X' in v2, and for
+ * commands only v2 frames carry, if the FC takes them. 0 if it
+ * doesn't.
+ */
+static char
+msp_frame_tag(struct msp *msp, msp_cmd_t cmd)
+{
+    if (msp->framing == MSP_FRAMING_V2)
+        return 'X';
+
+    if (cmd <= MSP_V1_CMD_MAX)
+        return 'M';
+
+    return msp->framings & (1 << MSP_FRAMING_V2) ? 'X' : 0;
+}
+
+size_t
+msp_frame_size(struct msp *msp, msp_cmd_t cmd, size_t len)
+{
+    size_t hlen;
+
+    if (msp_frame_tag(msp, cmd) == 'X')
+        hlen = MSP_HDR_MAX;
+    else if (len >= MSP_JUMBO_LEN && msp->framing != MSP_FRAMING_V0)
+        hlen = MSP_HDR_MIN + sizeof(uint16_t);
+    else
+        hlen = MSP_HDR_MIN;
+
+    return hlen + len + sizeof(uint8_t);
+}
+
+static ssize_t
+msp_frame_encode(struct msp *msp, void *buf,
+                 msp_cmd_t cmd, const void *args, size_t len)
+{
+    struct msp_hdr hdr;
+    uint8_t *pos, cks;
+    char tag;
+    int rc;
+
+    if (unexpected(len > msp->lenmax)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    tag = msp_frame_tag(msp, cmd);
+    if (unexpected(!tag)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    hdr = MSP_REQ_HDR(cmd, len);
+    hdr.tag[1] = tag;
+
+    pos = buf;
+    pos += msp_hdr_encode(&hdr, pos);
+
+    if (len) {
+        rc = msp_msg_encode_req(&hdr, args, pos, &cks);
+        if (unexpected(rc))
+            return -1;
+
+        pos += len;
+    } else
+        cks = msp_msg_checksum(&hdr, NULL);
+
+    *pos++ = cks;
+
+    return pos - (uint8_t *)buf;
+}
+
+int
+msp_set_framing(struct msp *msp, enum msp_framing framing, size_t lenmax)
+{
+    size_t max;
+
+    switch (framing) {
+    case MSP_FRAMING_V0:
+        max = MSP_JUMBO_LEN - 1;
+        break;
+    case MSP_FRAMING_V1:
+    case MSP_FRAMING_V2:
+        max = MSP_LEN_MAX;
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (lenmax > max) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    msp->framing = framing;
+    msp->framings |= 1 << framing;
+    msp->lenmax = lenmax ? : max;
+
+    return 0;
+}
+
+/*
+ * A call keeps to the class of any unsent call on its command,
+ * or the two could pass each other on the wire.
+ */
+static enum msp_prio
+msp_req_prio(struct msp *msp, const struct msp_req *req)
+{
+    struct msp_slot *slot = msp_slot(msp, req->cmd);
+    struct msp_call *call;
+
+    list_for_each_entry(&slot->calls, call, entry)
+        if (!list_is_empty(&call->txentry))
+            return call->prio;
+
+    return req->prio ? req->prio : slot->prio;
+}
+
+static void
+msp_call_inflight(struct msp *msp, struct msp_call *call)
+{
+    if (call->prio == MSP_PRIO_CONTROL)
+        return;
+
+    call->inflight = 1;
+    msp->inflight++;
+}
+
+static int
+msp_tx_held(struct msp *msp, enum msp_prio prio)
+{
+    int i;
+
+    for (i = MSP_PRIO_CONTROL; i <= prio; i++)
+        if (!list_is_empty(&msp->txq[i]))
+            return 1;
+
+    return 0;
+}
+
+static int
+msp_tx_window(struct msp *msp, enum msp_prio prio)
+{
+    return prio == MSP_PRIO_CONTROL ||
+        !msp->wmax || msp->inflight < (int)msp->cwnd;
+}
+
+/*
+ * Whether a frame of @len in class @prio fits under the cap,
+ * with @ahead bytes already lined up for the same write.
+ */
+static int
+msp_tx_room(struct msp *msp, enum msp_prio prio, size_t len, size_t ahead)
+{
+    int outq;
+
+    if (prio == MSP_PRIO_CONTROL)
+        return 1;
+
+    outq = tty_outq(msp->tty);
+    ahead += max(outq, 0) + msp->txpendlen;
+
+    return !ahead || ahead + len <= msp->txcap;
+}
+
+/*
+ * Come back when the driver has drained enough for @len more.
+ */
+static void
+msp_tx_wait(struct msp *msp, size_t len)
+{
+    struct timeval timeo, delay;
+    unsigned long usecs;
+    size_t excess;
+    int outq;
+
+    outq = tty_outq(msp->tty);
+    outq = max(outq, 0);
+
+    excess = outq;
+    if (len <= msp->txcap)
+        excess = outq + len > msp->txcap ? outq + len - msp->txcap : 0;
+
+    usecs = msp_wire_usecs(msp, excess);
+    usecs = max(usecs, MSP_RTO_GRANULARITY);
+
+    delay.tv_sec = usecs / 1000000;
+    delay.tv_usec = usecs % 1000000;
+
+    gettimeofday(&timeo, NULL);
+    timeradd(&timeo, &delay, &timeo);
+
+    evtloop_add_timer(msp->loop, msp->txtimer, &timeo);
+}
+
+/*
+ * Write @len bytes, behind any the driver wouldn't take before.
+ * What it won't take now waits in txpend, and goes out ahead of
+ * everything else from msp_tx_drain.
+ */
+static int
+msp_tx_write(struct msp *msp, const void *buf, size_t len)
+{
+    ssize_t n;
+    size_t size;
+
+    n = 0;
+
+    if (!msp->txpendlen) {
+        n = tty_send(msp->tty, buf, len);
+        if (n < 0)
+            return -1;
+
+        if (n == len)
+            return 0;
+    }
+
+    size = msp->txpendlen + len - n;
+    if (size > msp->txpendsize) {
+        uint8_t *pend;
+
+        pend = realloc(msp->txpend, size);
+        if (!expected(pend))
+            return -1;
+
+        msp->txpend = pend;
+        msp->txpendsize = size;
+    }
+
+    memcpy(msp->txpend + msp->txpendlen, (const uint8_t *)buf + n, len - n);
+    msp->txpendlen += len - n;
+
+    msp_tx_wait(msp, 0);
+
+    return 0;
+}
+
+/*
+ * Whether bytes are still pending. Should the write fail, the
+ * frames in them are lost, and their calls time out.
+ */
+static int
+msp_tx_flush(struct msp *msp)
+{
+    ssize_t n;
+
+    if (!msp->txpendlen)
+        return 0;
+
+    n = tty_send(msp->tty, msp->txpend, msp->txpendlen);
+    if (n < 0)
+        n = msp->txpendlen;
+
+    msp->txpendlen -= n;
+    memmove(msp->txpend, msp->txpend + n, msp->txpendlen);
+
+    return msp->txpendlen > 0;
+}
+
+static void
+msp_tx_drain(struct msp *msp)
+{
+    struct msp_call *call;
+    struct timeval now;
+    int prio, rc;
+
+    if (msp_tx_flush(msp)) {
+        msp_tx_wait(msp, 0);
+        return;
+    }
+
+    for (prio = MSP_PRIO_CONTROL; prio <= MSP_PRIO_BULK; prio++) {
+        struct list *txq = &msp->txq[prio];
+
+        while ((call = list_first_entry(txq, struct msp_call, txentry))) {
+            gettimeofday(&now, NULL);
+
+            if (msp_call_expired(call, &now)) {
+                msp_call_abort(msp, call, ETIMEDOUT);
+                continue;
+            }
+
+            /* a completion will reopen it */
+            if (!msp_tx_window(msp, prio))
+                return;
+
+            if (!msp_tx_room(msp, prio, call->flen, 0)) {
+                msp_tx_wait(msp, call->flen);
+                return;
+            }
+
+            list_remove_init(&call->txentry);
+            msp_call_inflight(msp, call);
+
+            rc = msp_tx_write(msp, call->frame, call->flen);
+            if (rc) {
+                msp_call_complete(msp, call, errno, NULL, NULL);
+                continue;
+            }
+
+            msp_call_sent(msp, call, &now);
+
+            if (!msp_slot(msp, call->cmd)->retry.cnt)
+                call->frame = NULL;
+        }
+    }
+}
+
+static void
+msp_tx_timeo(const struct timeval *timeo, void *data)
+{
+    msp_tx_drain(data);
+}
+
+/*
+ * On return, @calls holds the pending call for each request, or
+ * NULL where a stashed response answered it already. Frames the
+ * scheduler holds back wait in their class queue, the rest go
+ * out in a single write.
+ */
+static int
+__msp_call_batch(struct msp *msp,
+                 const struct msp_req *reqs, int cnt,
+                 const struct timeval *timeo, struct msp_call **calls)
+{
+    const struct msp_req *req;
+    struct timeval now;
+    size_t size, off;
+    int rc, i, n, held;
+
+    n = 0;
+    rc = -1;
+    held = 0;
+
+    size = 0;
+    for (i = 0; i < cnt; i++) {
+        req = &reqs[i];
+
+        if (unexpected(req->len > MSP_LEN_MAX)) {
+            errno = EINVAL;
+            goto out;
+        }
+
+        /* only v2 frames carry 16 bit commands */
+        if (unexpected(!msp_frame_tag(msp, req->cmd))) {
+            errno = EINVAL;
+            goto out;
+        }
+
+        size += msp_frame_size(msp, req->cmd, req->len);
+    }
+
+    rc = msp_txbuf_reserve(msp, size);
+    if (rc)
+        goto out;
+
+    gettimeofday(&now, NULL);
+
+    off = 0;
+    for (n = 0; n < cnt; n++) {
+        struct msp_call *call;
+        enum msp_prio prio;
+        ssize_t len;
+        int room;
+
+        req = &reqs[n];
+        calls[n] = NULL;
+
+        rc = msp_slot_add(msp, req->cmd) ? 0 : -1;
+        if (rc)
+            goto out;
+
+        msp_stash_drop(msp, req->cmd);
+
+        if (msp_stash_valid(msp, req, &now))
+            continue;
+
+        if (timerisset(&req->deadline) &&
+            !timercmp(&now, &req->deadline, <)) {
+            errno = ETIMEDOUT;
+            rc = -1;
+            goto out;
+        }
+
+        prio = msp_req_prio(msp, req);
+
+        call = msp_call_init(msp, req, timeo);
+
+        rc = expected(call) ? 0 : -1;
+        if (rc)
+            goto out;
+
+        calls[n] = call;
+
+        if (call->leader)
+            continue;
+
+        call->prio = prio;
+        call->len = req->len;
+
+        len = msp_frame_encode(msp, msp->txbuf + off,
+                               req->cmd, req->args, req->len);
+
+        rc = len < 0 ? -1 : 0;
+        if (rc) {
+            n++;
+            goto out;
+        }
+
+        room = !msp_tx_held(msp, prio) &&
+            msp_tx_window(msp, prio) &&
+            msp_tx_room(msp, prio, len, off);
+
+        if (!room || msp_slot(msp, req->cmd)->retry.cnt) {
+            if (!call->fbuf)
+                call->fbuf = malloc(MSP_FRAME_MAX);
+            if (expected(call->fbuf)) {
+                memcpy(call->fbuf, msp->txbuf + off, len);
+                call->frame = call->fbuf;
+                call->flen = len;
+            }
+        }
+
+        if (!room) {
+            rc = call->frame ? 0 : -1;
+            if (rc) {
+                n++;
+                goto out;
+            }
+
+            list_insert_tail(&msp->txq[prio], &call->txentry);
+            held++;
+
+            if (timerisset(&call->deadline))
+                evtloop_add_timer(msp->loop, &call->timer, &call->deadline);
+            continue;
+        }
+
+        msp_call_inflight(msp, call);
+        off += len;
+    }
+
+    rc = off ? msp_tx_write(msp, msp->txbuf, off) : 0;
+    if (rc)
+        goto out;
+
+    for (i = 0; i < cnt; i++) {
+        struct msp_call *call = calls[i];
+
+        if (call && !call->leader && list_is_empty(&call->txentry))
+            msp_call_sent(msp, call, &now);
+    }
+
+    if (held)
+        msp_tx_drain(msp);
+
+    for (i = 0; i < cnt; i++)
+        if (!calls[i])
+            msp_stash_return(msp, &reqs[i]);
+out:
+    if (rc) {
+        int err = errno;
+
+        while (n--)
+            if (calls[n])
+                msp_call_exit(msp, calls[n]);
+
+        errno = err;
+    }
+
+    return rc;
+}
+
+int
+msp_call_submit(struct msp *msp, const struct msp_req *req,
+                const struct timeval *timeo, struct msp_call **callp)
+{
+    return __msp_call_batch(msp, req, 1, timeo, callp);
+}
+
+int
+msp_call_batch(struct msp *msp,
+               const struct msp_req *reqs, int cnt,
+               const struct timeval *timeo)
+{
+    struct msp_call *local[MSP_BATCH_LOCAL], **calls;
+    int rc;
+
+    if (unexpected(cnt <= 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    calls = local;
+    if (cnt > array_size(local)) {
+        calls = calloc(cnt, sizeof(*calls));
+        if (!expected(calls))
+            return -1;
+    }
+
+    rc = __msp_call_batch(msp, reqs, cnt, timeo, calls);
+
+    if (calls != local)
+        free(calls);
+
+    return rc;
+}
+
+int
+msp_call(struct msp *msp,
+         msp_cmd_t cmd, const void *args, size_t len,
+         msp_call_retfn rfn, void *priv, const struct timeval *timeo)
+{
+    struct msp_call *call;
+    struct msp_req req = {
+        .cmd = cmd,
+        .args = args,
+        .len = len,
+        .rfn = rfn,
+        .priv = priv,
+    };
+
+    return msp_call_submit(msp, &req, timeo, &call);
+}
+
+int
+msp_pollfd(struct msp *msp, struct pollfd *pfd)
+{
+    int n;
+
+    n = evtloop_pollfds(msp->loop, pfd, 1);
+    if (!expected(n == 1)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+msp_deadline(struct msp *msp, struct timeval *deadline)
+{
+    return evtloop_deadline(msp->loop, deadline);
+}
+
+void
+msp_process(struct msp *msp, int revents, const struct timeval *now)
+{
+    struct pollfd pfd;
+    int n;
+
+    n = evtloop_pollfds(msp->loop, &pfd, 1);
+
+    pfd.revents = revents;
+
+    evtloop_dispatch(msp->loop, &pfd, n ? 1 : 0, now);
+}
+
+void
 msp_sync(struct msp *msp, msp_cmd_t cmd)
 {
     do {
@@ -353,11 +2134,8 @@ msp_sync(struct msp *msp, msp_cmd_t cmd)
         if (!call)
             break;
 
-        if (!call->timer)
-            break;
-
         rc = evtloop_iterate(msp->loop);
-        if (rc)
+        if (rc && errno != ETIMEDOUT)
             break;
 
     } while (1);
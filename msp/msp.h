@@ -18,12 +18,266 @@ typedef void (*msp_call_retfn)(int err,
                                const struct msp_hdr *, void *data,
                                void *priv);
 
+/*
+ * A NULL @timeo picks the command's adaptive timeout, see
+ * msp_set_rto. A NULL @rfn completes the call to the completion
+ * queue instead, see msp_reap. @args is only read, and not used
+ * after msp_call returns.
+ *
+ * Reads without arguments coalesce: when @cmd already has its
+ * full depth of calls in flight, the call attaches to the newest
+ * one and gets a copy of its response, instead of failing with
+ * EBUSY.
+ */
 int msp_call(struct msp *msp,
-             msp_cmd_t cmd, void *args, size_t len,
+             msp_cmd_t cmd, const void *args, size_t len,
              msp_call_retfn rfn, void *priv, const struct timeval *timeo);
 
+enum msp_prio {
+    MSP_PRIO_DEFAULT,        /* the command's class */
+    MSP_PRIO_CONTROL,
+    MSP_PRIO_TELEMETRY,
+    MSP_PRIO_BULK,
+};
+
+struct msp_req {
+    msp_cmd_t cmd;
+    const void *args;
+    size_t len;
+    msp_call_retfn rfn;
+    void *priv;
+    enum msp_prio prio;
+    struct timeval deadline;
+    void *rsp;
+    size_t rsplen;
+    void *key;
+    void (*release)(void *priv);
+};
+
+/*
+ * Submit @cnt requests at once. Frames are encoded back-to-back
+ * into one tx buffer and, as far as msp_set_prio lets them,
+ * written with a single syscall, so the calls are in flight
+ * together. Each completes through its own rfn as responses
+ * arrive. Fails as a whole, with no call left pending, if any
+ * request can't be submitted, and with EINVAL if @cnt isn't
+ * positive.
+ *
+ * A request with a deadline, in gettimeofday time, fails with
+ * ETIMEDOUT once it passes. If still queued for tx, it is
+ * dropped unsent; if on the wire, it is neither resent nor
+ * waited for any longer. One already past fails to submit.
+ *
+ * A response which fits in @rsplen is copied to @rsp once its
+ * checksum matches, and rfn gets @rsp as its data, which it must
+ * not free. The buffer must stay valid until the call completes,
+ * or is cancelled.
+ *
+ * Wrappers whose @priv is their own state, around their caller's,
+ * set @release to free it for a call dropped without calling
+ * back, like one pending at msp_close. msp_call_cancel then
+ * matches @key instead of @priv.
+ */
+int msp_call_batch(struct msp *msp,
+                   const struct msp_req *reqs, int cnt,
+                   const struct timeval *timeo);
+
+/*
+ * Cancel the pending calls on @cmd with @priv, or @key. Each completes
+ * with ECANCELED before this returns. A response that is still
+ * due is read and dropped, or goes to calls riding along on the
+ * cancelled one. Returns the number of calls cancelled.
+ */
+int msp_call_cancel(struct msp *msp, msp_cmd_t cmd, void *priv);
+
 void msp_sync(struct msp *msp, msp_cmd_t cmd);
 
+struct msp_cqe {
+    void *tag;               /* the call's priv */
+    int err;
+    struct msp_hdr hdr;      /* unless err */
+    void *data;              /* payload, the caller frees it */
+};
+
+/*
+ * Calls without an rfn complete into a queue, which grows as
+ * needed, instead of calling back from the rx path. Moves up to
+ * @n of them to @cqes, oldest first, and returns how many. Never
+ * blocks, run the event loop to wait for more.
+ */
+int msp_reap(struct msp *msp, struct msp_cqe *cqes, int n);
+
+/*
+ * Host event loops. Give msp_open a loop of its own with just
+ * the tty plugged in, and never iterate it: poll the fd from
+ * msp_pollfd instead, wake up no later than msp_deadline, and
+ * pass what poll returned to msp_process. A NULL @now means
+ * now. msp_deadline fails with ENOENT while nothing is pending.
+ * msp_sync still iterates the loop, so stick to async calls.
+ */
+int msp_pollfd(struct msp *msp, struct pollfd *pfd);
+
+int msp_deadline(struct msp *msp, struct timeval *deadline);
+
+void msp_process(struct msp *msp, int revents, const struct timeval *now);
+
+/*
+ * Handlers for frames no call is waiting for: unsolicited
+ * pushes from the FC, and responses that arrive after their
+ * call expired. A per-command handler takes precedence over the
+ * default one. Frames nobody handles are read and dropped. Pass
+ * a NULL fn to unregister.
+ */
+void msp_set_push_handler(struct msp *msp, msp_cmd_t cmd,
+                          msp_call_retfn fn, void *priv);
+
+void msp_set_push_default(struct msp *msp,
+                          msp_call_retfn fn, void *priv);
+
+struct msp_stat {
+    unsigned long cnt;       /* calls answered */
+    unsigned long timeouts;  /* requests timed out */
+    unsigned long wire;      /* last exchange, usecs on the wire */
+    unsigned long srtt;      /* smoothed round trip, usecs */
+    unsigned long rto;       /* current adaptive timeout, usecs */
+    unsigned long retries;   /* requests resent */
+    unsigned long p50;       /* round trip percentiles, usecs */
+    unsigned long p99;
+    unsigned long p999;
+    unsigned long max;
+};
+
+int msp_stat(struct msp *msp, msp_cmd_t cmd, struct msp_stat *st);
+
+/*
+ * Commands with stats to report, in order: every v1 command, then
+ * the v2 ones in use. Start from 0, which also marks the end.
+ */
+msp_cmd_t msp_stat_next(struct msp *msp, msp_cmd_t cmd);
+
+/*
+ * Calls without an explicit timeout expire after a per-command
+ * RTO, computed TCP style from the smoothed round trip time and
+ * its variance, doubled on each timeout, and clamped to
+ * [@min, @max]. Defaults are 20ms and 1s.
+ */
+void msp_set_rto(struct msp *msp,
+                 const struct timeval *min, const struct timeval *max);
+
+const struct timeval *msp_rto(struct msp *msp, msp_cmd_t cmd,
+                              struct timeval *rto);
+
+struct msp_retry {
+    int cnt;                 /* resends after a timeout */
+    struct timeval backoff;  /* delay before the first resend */
+    int jitter;              /* +/- percent of the delay */
+};
+
+/*
+ * Resend policy for calls on @cmd which time out. Known read
+ * commands default to 2 resends, 5ms backoff and 50% jitter.
+ * Commands which change FC state, and unknown ones, default to
+ * none; set a policy here to opt in.
+ */
+void msp_set_retry(struct msp *msp, msp_cmd_t cmd,
+                   const struct msp_retry *retry);
+
+/*
+ * Answer reads on @cmd from the last response received, as long
+ * as it is younger than @stale. Such calls complete before
+ * msp_call returns. A zero @stale turns this off, the default
+ * for all but the static reads below.
+ *
+ * MSP_STALE_FOREVER keeps a response until a write makes it
+ * stale: MSP_SET_* on the matching read, or writes which change
+ * the FC's configuration as a whole, like MSP_EEPROM_WRITE or
+ * MSP_RESET_CONF. Unknown commands drop nothing. MSP_IDENT,
+ * MSP_BOX, MSP_BOXNAMES, MSP_PIDNAMES and MSP_BOXIDS default to
+ * it.
+ */
+#define MSP_STALE_FOREVER ((struct timeval) { .tv_sec = -1 })
+
+void msp_set_stale(struct msp *msp, msp_cmd_t cmd,
+                   const struct timeval *stale);
+
+#define MSP_DEPTH_MAX 16
+
+/*
+ * Max number of calls in flight for @cmd. Defaults to 1, where
+ * a second msp_call on the same command fails with EBUSY.
+ */
+int msp_set_depth(struct msp *msp, msp_cmd_t cmd, int depth);
+
+/*
+ * Requests go out highest class first. Control frames are
+ * written at once, the others only while the driver holds less
+ * than @cap bytes, so at most @cap bytes, or one frame, ever sit
+ * ahead of a control frame. The cap defaults to one v0 frame of
+ * 255 bytes. Calls on one command stay in order, a call queued
+ * behind an unsent one takes its class.
+ *
+ * By default, MSP_SET_RAW_RC, MSP_SET_RAW_GPS, MSP_SET_HEAD and
+ * MSP_SET_MOTOR are control, config reads and writes are bulk,
+ * the rest is telemetry.
+ */
+int msp_set_prio(struct msp *msp, msp_cmd_t cmd, enum msp_prio prio);
+
+void msp_set_txcap(struct msp *msp, size_t cap);
+
+/*
+ * Limit the requests in flight, over all commands, to a window
+ * of at most @max. The window starts at 1, doubles per window of
+ * timely responses up to the last loss, then grows by one. It
+ * halves on every timeout or corrupt frame. Control frames don't
+ * count. Useful on high latency links, together with deeper
+ * per-command queues. A zero @max, the default, turns it off.
+ */
+int msp_set_window(struct msp *msp, int max);
+
+/*
+ * Current window, or 0 when off. @inflight, if given, receives
+ * the number of requests in flight.
+ */
+int msp_window(struct msp *msp, int *inflight);
+
+enum msp_framing {
+    MSP_FRAMING_V0,
+    MSP_FRAMING_V1, /* v0 and jumbo frames */
+    MSP_FRAMING_V2,
+};
+
+/*
+ * Frame requests as @framing, with payloads of up to @lenmax, or
+ * 0 for the most the framing carries. A session starts out at
+ * v0, which takes requests under MSP_JUMBO_LEN. Longer ones fail
+ * with EMSGSIZE. Commands past MSP_V1_CMD_MAX go out in v2 frames
+ * once the FC is known to take them, from this or msp_negotiate,
+ * and fail with EINVAL before; their payloads go out and come
+ * back as is. Responses are read in any framing, and in v1 or v2, a v0
+ * length of MSP_JUMBO_LEN marks a jumbo frame.
+ */
+int msp_set_framing(struct msp *msp, enum msp_framing framing,
+                    size_t lenmax);
+
+struct msp_proto {
+    struct msp_api_version api;
+    unsigned int framings;  /* 1 << enum msp_framing, as answered */
+    size_t lenmax;
+};
+
+/*
+ * Probe the FC with MSP_API_VERSION calls: in v0, in jumbo frames
+ * padded to MSP_LEN_MAX and halving down to MSP_JUMBO_LEN, then
+ * in v2. Firmware which answers gets v1 framing, which sends v0
+ * frames where the payload fits and jumbo frames where it does
+ * not, up to the largest payload answered. v2 frames are never
+ * shorter, and only carry commands past MSP_V1_CMD_MAX, if the
+ * v2 probe was answered. Firmware which does not answer stays at
+ * v0. @proto, if given, receives what was
+ * found. Run it after msp_open, before other calls.
+ */
+int msp_negotiate(struct msp *msp, struct msp_proto *proto);
+
 #endif
 
 /*
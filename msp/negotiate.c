@@ -0,0 +1,226 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <msp/msp.h>
+#include <msp/msp-internal.h>
+
+#include <crt/defs.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+struct msp_probe {
+    int err;
+    struct msp_hdr hdr;
+    struct msp_api_version api;
+};
+
+static void
+msp_probe_retfn(int err, const struct msp_hdr *hdr, void *data, void *priv)
+{
+    struct msp_probe *probe = priv;
+
+    probe->err = err;
+
+    if (!err) {
+        probe->hdr = *hdr;
+        memcpy(&probe->api, data, min(hdr->len, sizeof(probe->api)));
+    }
+
+    if (data)
+        free(data);
+}
+
+/*
+ * How long to wait for the answer to a probe of @len: @rto, and
+ * the time both frames take on the wire.
+ */
+static void
+msp_probe_timeo(struct msp *msp, const struct timeval *rto, size_t len,
+                struct timeval *timeo)
+{
+    struct timeval wire;
+    unsigned long usecs;
+
+    usecs = msp_wire_usecs(msp,
+                           msp_frame_size(msp, MSP_API_VERSION, len) +
+                           msp_frame_size(msp, MSP_API_VERSION,
+                                          sizeof(struct msp_api_version)));
+
+    wire.tv_sec = usecs / 1000000;
+    wire.tv_usec = usecs % 1000000;
+
+    timeradd(rto, &wire, timeo);
+}
+
+static void
+msp_probe_done(const struct timeval *timeo, void *data)
+{
+    int *done = data;
+
+    *done = 1;
+}
+
+/*
+ * Give a late answer to a probe that timed out as long again to
+ * come in, with no call to complete. It goes to the push handlers
+ * instead of answering the next probe.
+ */
+static void
+msp_probe_drain(struct msp *msp, const struct timeval *timeo)
+{
+    struct timeval end;
+    struct timer timer;
+    int done, rc;
+
+    done = 0;
+    timer_init(&timer, msp_probe_done, &done);
+
+    gettimeofday(&end, NULL);
+    timeradd(&end, timeo, &end);
+    evtloop_add_timer(msp->loop, &timer, &end);
+
+    while (!done) {
+        rc = evtloop_iterate(msp->loop);
+        if (rc && errno != ETIMEDOUT)
+            break;
+    }
+
+    timer_stop(&timer);
+}
+
+/*
+ * One MSP_API_VERSION call, with @len bytes of @pad, timed from
+ * @rto if given. Returns 1 when answered in full, 0 when not, -1
+ * if the call fails.
+ */
+static int
+msp_probe(struct msp *msp, const void *pad, size_t len,
+          const struct timeval *rto, struct msp_probe *probe)
+{
+    struct timeval timeo;
+    int rc;
+
+    *probe = (struct msp_probe) { 0 };
+
+    if (rto)
+        msp_probe_timeo(msp, rto, len, &timeo);
+
+    rc = msp_call(msp, MSP_API_VERSION, pad, len,
+                  msp_probe_retfn, probe, rto ? &timeo : NULL);
+    if (rc)
+        return -1;
+
+    msp_sync(msp, MSP_API_VERSION);
+
+    if (rto && probe->err == ETIMEDOUT)
+        msp_probe_drain(msp, &timeo);
+
+    return !probe->err &&
+        probe->hdr.dsc == '>' &&
+        probe->hdr.len >= sizeof(probe->api);
+}
+
+/*
+ * Once the FC answered, an unanswered probe means it did not take
+ * the frame, not that the link lost it. The rest go out once, and
+ * wait as long as the first took to be answered, plus their time
+ * on the wire.
+ */
+int
+msp_negotiate(struct msp *msp, struct msp_proto *proto)
+{
+    struct msp_slot *slot = &msp->tab[MSP_TAB_IDX(MSP_API_VERSION)];
+    struct msp_retry retry = slot->retry;
+    struct msp_proto found;
+    struct msp_probe probe;
+    struct timeval rto;
+    uint8_t *pad;
+    size_t len;
+    int rc;
+
+    pad = NULL;
+
+    found = (struct msp_proto) {
+        .framings = 1 << MSP_FRAMING_V0,
+        .lenmax = MSP_JUMBO_LEN - 1,
+    };
+
+    rc = msp_set_framing(msp, MSP_FRAMING_V0, 0);
+    if (rc)
+        goto out;
+
+    rc = msp_probe(msp, NULL, 0, NULL, &probe);
+    if (rc <= 0)
+        goto out;
+
+    found.api = probe.api;
+    found.framings |= 1 << MSP_FRAMING_V1;
+
+    msp_rto(msp, MSP_API_VERSION, &rto);
+    slot->retry = (struct msp_retry) { 0 };
+
+    rc = -1;
+    pad = calloc(1, MSP_LEN_MAX);
+    if (!expected(pad))
+        goto out;
+
+    rc = msp_set_framing(msp, MSP_FRAMING_V1, 0);
+    if (rc)
+        goto out;
+
+    for (len = MSP_LEN_MAX; len >= MSP_JUMBO_LEN; len /= 2) {
+        rc = msp_probe(msp, pad, len, &rto, &probe);
+        if (rc < 0)
+            goto out;
+
+        if (rc) {
+            found.lenmax = len;
+            break;
+        }
+    }
+
+    rc = msp_set_framing(msp, MSP_FRAMING_V2, 0);
+    if (rc)
+        goto out;
+
+    rc = msp_probe(msp, NULL, 0, &rto, &probe);
+    if (rc < 0)
+        goto out;
+
+    if (rc && probe.hdr.tag[1] == 'X')
+        found.framings |= 1 << MSP_FRAMING_V2;
+
+    rc = msp_set_framing(msp, MSP_FRAMING_V1, found.lenmax);
+out:
+    slot->retry = retry;
+
+    if (rc < 0)
+        msp_set_framing(msp, MSP_FRAMING_V0, 0);
+
+    /* v2 frames go out for the commands only they carry */
+    msp->framings = rc < 0 ? 1 << MSP_FRAMING_V0 : found.framings;
+
+    if (rc > 0)
+        rc = 0;
+
+    if (!rc && proto)
+        *proto = found;
+
+    if (pad)
+        free(pad);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
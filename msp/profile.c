@@ -0,0 +1,302 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <msp/profile.h>
+#include <msp/msp-internal.h>
+
+#include <crt/defs.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MSP_PROFILE_MAGIC   "MSPP"
+#define MSP_PROFILE_VERSION 3
+
+/*
+ * File layout: the header, @devlen bytes of device path, then
+ * one entry per cached response, each followed by @len bytes.
+ */
+struct msp_profile_hdr {
+    char magic[4];
+    uint8_t version;
+    struct msp_profile_key key;
+    uint8_t devlen;
+} PACKED;
+
+struct msp_profile_ent {
+    msp_cmd_t cmd;
+    msp_len_t len;
+} PACKED;
+
+static const msp_cmd_t msp_profile_cmds[] = {
+    MSP_BOXNAMES,
+    MSP_BOXIDS,
+    MSP_PIDNAMES,
+};
+
+static int
+msp_profile_cmd(msp_cmd_t cmd)
+{
+    int i;
+
+    for (i = 0; i < array_size(msp_profile_cmds); i++)
+        if (msp_profile_cmds[i] == cmd)
+            return 1;
+
+    return 0;
+}
+
+static void
+msp_profile_retfn(int err, const struct msp_hdr *hdr, void *data, void *priv)
+{
+    struct msp_profile *prof = priv;
+
+    prof->pending--;
+
+    if (err) {
+        prof->err = err;
+        goto out;
+    }
+
+    switch (hdr->cmd) {
+    case MSP_IDENT:
+        memcpy(&prof->key.ident, data,
+               min(hdr->len, sizeof(prof->key.ident)));
+        break;
+
+    case MSP_STATUS: {
+        struct msp_status status = { 0 };
+
+        memcpy(&status, data, min(hdr->len, sizeof(status)));
+        prof->key.hwcaps = status.hwcaps;
+        prof->key.conf = status.conf;
+        break;
+    }
+    }
+out:
+    if (data)
+        free(data);
+}
+
+/*
+ * Prime the response cache from the file, if it was written for
+ * the same device and firmware. Anything unexpected in it just
+ * ends the load.
+ */
+static void
+msp_profile_load(struct msp_profile *prof)
+{
+    struct msp_profile_hdr fh;
+    char dev[UINT8_MAX];
+    FILE *f;
+
+    f = fopen(prof->path, "r");
+    if (!f)
+        return;
+
+    if (fread(&fh, sizeof(fh), 1, f) != 1)
+        goto out;
+
+    if (memcmp(fh.magic, MSP_PROFILE_MAGIC, sizeof(fh.magic)) ||
+        fh.version != MSP_PROFILE_VERSION ||
+        memcmp(&fh.key, &prof->key, sizeof(fh.key)))
+        goto out;
+
+    if (fh.devlen != strlen(prof->dev) ||
+        fread(dev, fh.devlen, 1, f) != 1 ||
+        memcmp(dev, prof->dev, fh.devlen))
+        goto out;
+
+    do {
+        struct msp_profile_ent ent;
+        uint8_t data[MSP_LEN_MAX];
+        struct msp_hdr hdr;
+
+        if (fread(&ent, sizeof(ent), 1, f) != 1 ||
+            ent.len > sizeof(data))
+            break;
+
+        if (ent.len && fread(data, ent.len, 1, f) != 1)
+            break;
+
+        if (!msp_profile_cmd(ent.cmd))
+            break;
+
+        hdr = (struct msp_hdr) {
+            .tag = { '$', 'M' },
+            .dsc = '>',
+            .len = ent.len,
+            .cmd = ent.cmd,
+        };
+
+        msp_stash(prof->msp, &hdr, data);
+    } while (1);
+out:
+    fclose(f);
+}
+
+struct msp_profile *
+msp_profile_open(struct msp *msp, const char *path, const char *dev)
+{
+    struct msp_profile *prof;
+    int rc;
+
+    rc = -1;
+
+    if (strlen(dev) > UINT8_MAX) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    prof = calloc(1, sizeof(*prof));
+    if (!expected(prof))
+        goto out;
+
+    prof->msp = msp;
+
+    prof->path = strdup(path);
+    if (!expected(prof->path))
+        goto out;
+
+    prof->dev = strdup(dev);
+    if (!expected(prof->dev))
+        goto out;
+
+    rc = msp_call(msp, MSP_IDENT, NULL, 0, msp_profile_retfn, prof, NULL);
+    if (rc)
+        goto out;
+    prof->pending++;
+
+    rc = msp_call(msp, MSP_STATUS, NULL, 0, msp_profile_retfn, prof, NULL);
+    if (rc)
+        goto out;
+    prof->pending++;
+
+    msp_sync(msp, MSP_IDENT);
+    msp_sync(msp, MSP_STATUS);
+
+    rc = prof->pending || prof->err ? -1 : 0;
+    if (rc) {
+        errno = prof->err ? : EIO;
+        goto out;
+    }
+
+    msp_profile_load(prof);
+out:
+    if (rc && prof) {
+        int err = errno;
+
+        msp_profile_close(prof);
+        prof = NULL;
+
+        errno = err;
+    }
+
+    return prof;
+}
+
+int
+msp_profile_save(struct msp_profile *prof)
+{
+    struct msp_profile_hdr fh;
+    char *tmp;
+    FILE *f;
+    int rc, i;
+
+    rc = -1;
+    f = NULL;
+
+    tmp = malloc(strlen(prof->path) + sizeof(".tmp"));
+    if (!expected(tmp))
+        goto out;
+
+    sprintf(tmp, "%s.tmp", prof->path);
+
+    f = fopen(tmp, "w");
+    if (!f)
+        goto out;
+
+    memcpy(fh.magic, MSP_PROFILE_MAGIC, sizeof(fh.magic));
+    fh.version = MSP_PROFILE_VERSION;
+    fh.key = prof->key;
+    fh.devlen = strlen(prof->dev);
+
+    if (fwrite(&fh, sizeof(fh), 1, f) != 1 ||
+        fwrite(prof->dev, fh.devlen, 1, f) != 1)
+        goto out;
+
+    for (i = 0; i < array_size(msp_profile_cmds); i++) {
+        struct msp_profile_ent ent;
+        const void *data;
+        msp_len_t len;
+
+        ent.cmd = msp_profile_cmds[i];
+
+        if (msp_stash_get(prof->msp, ent.cmd, &data, &len))
+            continue;
+
+        ent.len = len;
+
+        if (fwrite(&ent, sizeof(ent), 1, f) != 1 ||
+            (ent.len && fwrite(data, ent.len, 1, f) != 1))
+            goto out;
+    }
+
+    rc = fclose(f);
+    f = NULL;
+    if (rc)
+        goto out;
+
+    rc = rename(tmp, prof->path);
+out:
+    if (rc && tmp) {
+        int err = errno;
+
+        if (f)
+            fclose(f);
+        unlink(tmp);
+
+        errno = err;
+    }
+
+    if (tmp)
+        free(tmp);
+
+    return rc;
+}
+
+void
+msp_profile_close(struct msp_profile *prof)
+{
+    struct msp *msp = prof->msp;
+    msp_cmd_t cmd[] = { MSP_IDENT, MSP_STATUS };
+    int i;
+
+    for (i = 0; prof->pending && i < array_size(cmd); i++) {
+        struct msp_slot *slot = &msp->tab[MSP_TAB_IDX(cmd[i])];
+        struct msp_call *call;
+
+        list_for_each_entry(&slot->calls, call, entry)
+            if (call->priv == prof)
+                msp_call_orphan(call);
+    }
+
+    if (prof->dev)
+        free(prof->dev);
+    if (prof->path)
+        free(prof->path);
+    free(prof);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
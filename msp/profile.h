@@ -0,0 +1,38 @@
+#ifndef MSP_PROFILE_H
+#define MSP_PROFILE_H
+
+#include <msp/msp.h>
+
+/*
+ * Static device metadata, kept across sessions in the file at
+ * @path: the MSP_BOXNAMES, MSP_BOXIDS and MSP_PIDNAMES responses.
+ * The file is keyed by @dev, the MSP_IDENT response, and the
+ * MSP_STATUS hwcaps and config setting.
+ *
+ * Opening a profile reads MSP_IDENT and MSP_STATUS, in one round
+ * trip. If they match the file, its responses go to the response
+ * cache, and reads of them complete without touching the link.
+ * A missing or stale file is not an error.
+ */
+struct msp_profile *msp_profile_open(struct msp *msp,
+                                     const char *path, const char *dev);
+
+/*
+ * Write back whatever the cache holds for the profile, replacing
+ * the file.
+ */
+int msp_profile_save(struct msp_profile *prof);
+
+void msp_profile_close(struct msp_profile *prof);
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
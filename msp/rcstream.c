@@ -0,0 +1,216 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <msp/rcstream.h>
+#include <msp/msp-internal.h>
+
+#include <crt/defs.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+static void
+msp_rc_stream_retfn(int err,
+                    const struct msp_hdr *hdr, void *data, void *priv)
+{
+    struct msp_rc_stream *rcs = priv;
+
+    if (data)
+        free(data);
+
+    rcs->unacked--;
+
+    if (err) {
+        rcs->lost++;
+        return;
+    }
+
+    rcs->acked++;
+    gettimeofday(&rcs->ackt, NULL);
+}
+
+static int
+msp_rc_stream_due(const struct msp_rc_stream *rcs,
+                  const struct timeval *now)
+{
+    struct timeval next;
+
+    if (memcmp(rcs->chn, &rcs->last, sizeof(rcs->last)))
+        return 1;
+
+    timeradd(&rcs->sent, &rcs->keepalive, &next);
+
+    return !timercmp(now, &next, <);
+}
+
+static int
+msp_rc_stream_send(struct msp_rc_stream *rcs, const struct timeval *now)
+{
+    struct msp_req req;
+    struct msp_call *call;
+    int rc;
+
+    if (!msp_rc_stream_due(rcs, now))
+        return 0;
+
+    req = (struct msp_req) {
+        .cmd = MSP_SET_RAW_RC,
+        .args = rcs->chn,
+        .len = sizeof(*rcs->chn),
+        .rfn = msp_rc_stream_retfn,
+        .priv = rcs,
+    };
+
+    rc = msp_call_submit(rcs->msp, &req, NULL, &call);
+    if (rc) {
+        if (errno == EBUSY)
+            rcs->busy++;
+        return rc;
+    }
+
+    rcs->last = *rcs->chn;
+    rcs->sent = *now;
+    rcs->unacked++;
+    rcs->nsent++;
+
+    return 0;
+}
+
+static void
+msp_rc_stream_tick(const struct timeval *timeo, void *data)
+{
+    struct msp_rc_stream *rcs = data;
+    struct timeval now, next;
+
+    gettimeofday(&now, NULL);
+
+    timeradd(timeo, &rcs->period, &next);
+    if (timercmp(&next, &now, <))
+        timeradd(&now, &rcs->period, &next);
+
+    evtloop_add_timer(rcs->msp->loop, rcs->timer, &next);
+
+    msp_rc_stream_send(rcs, &now);
+}
+
+struct msp_rc_stream *
+msp_rc_stream_open(struct msp *msp, const struct msp_raw_rc *chn,
+                   unsigned int hz, const struct timeval *keepalive)
+{
+    struct msp_slot *slot = &msp->tab[MSP_TAB_IDX(MSP_SET_RAW_RC)];
+    struct msp_rc_stream *rcs;
+    struct timeval now, next;
+    int rc;
+
+    rc = -1;
+    rcs = NULL;
+
+    if (!hz || hz > 1000) {
+        errno = EINVAL;
+        goto out;
+    }
+
+    rcs = calloc(1, sizeof(*rcs));
+    if (!expected(rcs))
+        goto out;
+
+    rcs->entry = LIST(&rcs->entry);
+    rcs->msp = msp;
+    rcs->chn = chn;
+    rcs->period.tv_sec = 1 / hz;
+    rcs->period.tv_usec = 1000000 / hz % 1000000;
+    rcs->keepalive = keepalive ? *keepalive : MSP_RC_STREAM_KEEPALIVE;
+
+    rcs->timer = __timer_create(msp_rc_stream_tick, rcs);
+    if (!expected(rcs->timer))
+        goto out;
+
+    if (list_is_empty(&msp->streams)) {
+        msp->rcdepth = slot->depth;
+        slot->depth = max(slot->depth, MSP_RC_STREAM_DEPTH);
+    }
+
+    list_insert_tail(&msp->streams, &rcs->entry);
+
+    gettimeofday(&now, NULL);
+    timeradd(&now, &rcs->period, &next);
+    evtloop_add_timer(msp->loop, rcs->timer, &next);
+
+    msp_rc_stream_send(rcs, &now);
+
+    rc = 0;
+out:
+    if (rc && rcs) {
+        int err = errno;
+
+        msp_rc_stream_close(rcs);
+        rcs = NULL;
+
+        errno = err;
+    }
+
+    return rcs;
+}
+
+void
+msp_rc_stream_close(struct msp_rc_stream *rcs)
+{
+    struct msp *msp = rcs->msp;
+    struct msp_slot *slot = &msp->tab[MSP_TAB_IDX(MSP_SET_RAW_RC)];
+    struct msp_call *call;
+
+    list_for_each_entry(&slot->calls, call, entry)
+        if (call->priv == rcs)
+            msp_call_orphan(call);
+
+    if (rcs->timer)
+        timer_destroy(rcs->timer);
+
+    if (!list_is_empty(&rcs->entry)) {
+        list_remove(&rcs->entry);
+
+        if (list_is_empty(&msp->streams) &&
+            slot->depth == max(msp->rcdepth, MSP_RC_STREAM_DEPTH))
+            slot->depth = msp->rcdepth;
+    }
+
+    free(rcs);
+}
+
+int
+msp_rc_stream_kick(struct msp_rc_stream *rcs)
+{
+    struct timeval now;
+
+    if (!memcmp(rcs->chn, &rcs->last, sizeof(rcs->last)))
+        return 0;
+
+    gettimeofday(&now, NULL);
+
+    return msp_rc_stream_send(rcs, &now);
+}
+
+void
+msp_rc_stream_stat(const struct msp_rc_stream *rcs,
+                   struct msp_rc_stream_stat *st)
+{
+    *st = (struct msp_rc_stream_stat) {
+        .sent = rcs->nsent,
+        .acked = rcs->acked,
+        .lost = rcs->lost,
+        .busy = rcs->busy,
+        .unacked = rcs->unacked,
+        .last = rcs->ackt,
+    };
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,56 @@
+#ifndef MSP_RCSTREAM_H
+#define MSP_RCSTREAM_H
+
+#include <msp/msp.h>
+
+#define MSP_RC_STREAM_DEPTH      4
+#define MSP_RC_STREAM_KEEPALIVE  (struct timeval) { 0, 100000 }
+
+/*
+ * RC override stream. The library samples @chn at @hz and sends
+ * MSP_SET_RAW_RC whenever it changed since the last frame, or
+ * when @keepalive (NULL: 100ms) passed without one. Callers
+ * just update @chn in place, it is never modified.
+ *
+ * Sends don't wait for the ack. Acks are consumed in the
+ * background and only counted, so the link health shows in
+ * msp_rc_stream_stat. Opening a stream raises the MSP_SET_RAW_RC
+ * depth to MSP_RC_STREAM_DEPTH; with that many frames unacked,
+ * sends are deferred to the next tick. Closing the last stream
+ * puts the depth back, unless it was changed in the meantime.
+ */
+struct msp_rc_stream *msp_rc_stream_open(struct msp *msp,
+                                         const struct msp_raw_rc *chn,
+                                         unsigned int hz,
+                                         const struct timeval *keepalive);
+
+void msp_rc_stream_close(struct msp_rc_stream *rcs);
+
+/*
+ * Send now if @chn changed, without waiting for the next tick.
+ */
+int msp_rc_stream_kick(struct msp_rc_stream *rcs);
+
+struct msp_rc_stream_stat {
+    unsigned long sent;     /* frames sent */
+    unsigned long acked;    /* acks received */
+    unsigned long lost;     /* acks timed out or failed */
+    unsigned long busy;     /* ticks deferred, too many unacked */
+    int unacked;            /* frames awaiting ack */
+    struct timeval last;    /* time of the last ack */
+};
+
+void msp_rc_stream_stat(const struct msp_rc_stream *rcs,
+                        struct msp_rc_stream_stat *st);
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
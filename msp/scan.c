@@ -0,0 +1,259 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <msp/scan.h>
+#include <msp/msg-internal.h>
+#include <msp/defs.h>
+
+#include <crt/defs.h>
+
+#include <string.h>
+#include <errno.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static int
+msp_scan_tag(const uint8_t *pos, int v2)
+{
+    return pos[0] == '$' && (pos[1] == 'M' || (v2 && pos[1] == 'X'));
+}
+
+/*
+ * The next preamble at or past @pos, or a lone '$' at the very
+ * end, else @end. Sixteen positions at a time, comparing the
+ * buffer and the buffer one byte on.
+ */
+static const uint8_t *
+msp_scan_find(const uint8_t *pos, const uint8_t *end, int v2, int scalar)
+{
+#ifdef __SSE2__
+    const __m128i dollar = _mm_set1_epi8('$');
+    const __m128i m = _mm_set1_epi8('M');
+    const __m128i x = _mm_set1_epi8(v2 ? 'X' : 'M');
+
+    while (!scalar && end - pos > 16) {
+        __m128i a, b;
+        int mask;
+
+        a = _mm_loadu_si128((const __m128i *)pos);
+        b = _mm_loadu_si128((const __m128i *)(pos + 1));
+
+        a = _mm_cmpeq_epi8(a, dollar);
+        b = _mm_or_si128(_mm_cmpeq_epi8(b, m), _mm_cmpeq_epi8(b, x));
+
+        mask = _mm_movemask_epi8(_mm_and_si128(a, b));
+        if (mask)
+            return pos + __builtin_ctz(mask);
+
+        pos += 16;
+    }
+#endif
+    for (; end - pos > 1; pos++)
+        if (msp_scan_tag(pos, v2))
+            return pos;
+
+    return pos < end && *pos == '$' ? pos : end;
+}
+
+static uint8_t
+msp_scan_xor(const struct msp_scan *scan, const uint8_t *pos, size_t len)
+{
+    uint8_t sum = 0;
+
+    if (!scan->scalar)
+        return msp_msg_xor(0, pos, len);
+
+    while (len--)
+        sum ^= *pos++;
+
+    return sum;
+}
+
+/*
+ * Size of the frame at @pos, 0 if it runs past @end, or -1 if it
+ * is no frame at all.
+ */
+static ssize_t
+msp_scan_frame(const struct msp_scan *scan,
+               const uint8_t *pos, const uint8_t *end,
+               struct msp_scan_frame *frame)
+{
+    size_t hlen, len, avail;
+    msp_cmd_t cmd;
+
+    avail = end - pos;
+
+    if (avail < MSP_HDR_MIN)
+        return 0;
+
+    if (pos[2] != '<' && pos[2] != '>' && pos[2] != '!')
+        return -1;
+
+    if (pos[1] == 'X') {
+        if (avail < MSP_HDR_MAX)
+            return 0;
+
+        cmd = pos[4] | pos[5] << 8;
+        len = pos[6] | pos[7] << 8;
+        hlen = MSP_HDR_MAX;
+    } else if (pos[3] == MSP_JUMBO_LEN &&
+               scan->framing != MSP_FRAMING_V0) {
+        if (avail < MSP_HDR_MIN + sizeof(uint16_t))
+            return 0;
+
+        cmd = pos[4];
+        len = pos[5] | pos[6] << 8;
+        hlen = MSP_HDR_MIN + sizeof(uint16_t);
+    } else {
+        cmd = pos[4];
+        len = pos[3];
+        hlen = MSP_HDR_MIN;
+    }
+
+    if (len > MSP_LEN_MAX)
+        return -1;
+
+    if (avail < hlen + len + 1)
+        return 0;
+
+    frame->hdr = (struct msp_hdr) {
+        .tag = { pos[0], pos[1] },
+        .dsc = pos[2],
+        .len = len,
+        .cmd = cmd,
+    };
+    frame->data = pos + hlen;
+
+    return hlen + len + 1;
+}
+
+int
+msp_scan(struct msp_scan *scan, const void *buf, size_t len,
+         size_t *pos, struct msp_scan_frame *frames, int n)
+{
+    const uint8_t *start, *end, *p;
+    int v2, cnt;
+
+    start = buf;
+    end = start + len;
+    p = start + *pos;
+
+    v2 = scan->framing == MSP_FRAMING_V2;
+
+    cnt = 0;
+    while (cnt < n) {
+        struct msp_scan_frame *frame = &frames[cnt];
+        const uint8_t *tag;
+        ssize_t size;
+        uint8_t cks;
+
+        /* back to back frames need no search */
+        tag = end - p > 1 && msp_scan_tag(p, v2) ?
+            p : msp_scan_find(p, end, v2, scan->scalar);
+
+        scan->junk += tag - p;
+        p = tag;
+
+        if (p == end)
+            break;
+
+        size = msp_scan_frame(scan, p, end, frame);
+        if (!size)
+            break;
+
+        if (size < 0) {
+            scan->junk++;
+            p++;
+            continue;
+        }
+
+        if (p[1] == 'X')
+            cks = msp_crc8_dvb_s2(0, p + 3, size - 4);
+        else
+            cks = msp_scan_xor(scan, p + 3, size - 4);
+
+        if (cks != p[size - 1]) {
+            scan->bad++;
+            scan->junk++;
+            p++;
+            continue;
+        }
+
+        frame->off = p - start;
+        scan->frames++;
+        cnt++;
+
+        p += size;
+    }
+
+    *pos = p - start;
+
+    return cnt;
+}
+
+/*
+ * Whether @type is made of 16-bit values alone, at a fixed size.
+ */
+static int
+msp_scan_type16(const struct msp_msg_type *type)
+{
+    const struct msp_msg_field *f;
+
+    if (type->var || type->min != type->max)
+        return 0;
+
+    for (f = type->fields; f < type->fields + type->nfields; f++) {
+        if (f->sub ? !msp_scan_type16(f->sub) : f->size != 2)
+            return 0;
+    }
+
+    return 1;
+}
+
+int
+msp_scan_columns(const struct msp_scan_frame *frames, int n,
+                 msp_cmd_t cmd, int16_t **cols, int ncols)
+{
+    const struct msp_msg_info *info = msp_msg_info(cmd);
+    int rows, i, j;
+
+    if (!info->sup || !msp_scan_type16(info->rsp) ||
+        info->max != ncols * sizeof(int16_t)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    rows = 0;
+    for (j = 0; j < n; j++) {
+        const struct msp_scan_frame *frame = &frames[j];
+        const uint8_t *pos = frame->data;
+
+        if (frame->hdr.cmd != cmd || frame->hdr.len < info->max ||
+            frame->hdr.dsc != '>')
+            continue;
+
+        for (i = 0; i < ncols; i++, pos += sizeof(int16_t)) {
+            int16_t v;
+
+            memcpy(&v, pos, sizeof(v));
+            cols[i][rows] = avrtoh(v);
+        }
+
+        rows++;
+    }
+
+    return rows;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
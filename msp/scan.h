@@ -0,0 +1,58 @@
+#ifndef MSP_SCAN_H
+#define MSP_SCAN_H
+
+#include <msp/msp.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Frames found in captured MSP byte streams, both directions
+ * mixed, junk in between. @framing says how to read a length of
+ * MSP_JUMBO_LEN, and whether '$' 'X' frames are expected. The
+ * counters add up over calls.
+ */
+struct msp_scan {
+    enum msp_framing framing;
+    int scalar;             /* no SIMD, for comparison */
+    unsigned long frames;   /* good ones */
+    unsigned long bad;      /* bad checksum */
+    unsigned long junk;     /* bytes skipped */
+};
+
+struct msp_scan_frame {
+    struct msp_hdr hdr;
+    const uint8_t *data;    /* payload, in the buffer */
+    size_t off;             /* of the frame */
+};
+
+/*
+ * Return up to @n frames with a good checksum from @buf, starting
+ * at *@pos. *@pos ends up past the last frame returned, or at a
+ * frame cut off by the end of @buf, to carry over to the next
+ * call.
+ */
+int msp_scan(struct msp_scan *scan, const void *buf, size_t len,
+             size_t *pos, struct msp_scan_frame *frames, int n);
+
+/*
+ * Decode the frames on @cmd among @frames into @ncols columns,
+ * host endian: value @i of row @j goes to cols[i][j]. The message
+ * must be all 16-bit values, @ncols of them, MSP_RAW_IMU, say.
+ * Frames on other commands, or short ones, are passed over.
+ * Returns the number of rows.
+ */
+int msp_scan_columns(const struct msp_scan_frame *frames, int n,
+                     msp_cmd_t cmd, int16_t **cols, int ncols);
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
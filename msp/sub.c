@@ -0,0 +1,477 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <msp/sub.h>
+#include <msp/msp-internal.h>
+#include <msp/msg-internal.h>
+
+#include <crt/defs.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define MSP_SUB_BUDGET        80 /* percent of wire rate */
+#define MSP_SUB_RATE_WINDOW   (struct timeval) { 1, 0 }
+
+static double
+tv2sec(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
+
+static struct timeval
+sec2tv(double sec)
+{
+    struct timeval tv;
+
+    tv.tv_sec = sec;
+    tv.tv_usec = (sec - tv.tv_sec) * 1000000;
+
+    return tv;
+}
+
+static size_t
+msp_sub_rsp_size(const struct msp_sub *sub)
+{
+    const struct msp_msg_info *info = msp_msg_info(sub->cmd);
+    size_t len;
+
+    len = info->sup ? info->max : MSP_LEN_MAX;
+
+    /* a v0 frame holds no more */
+    if (sub->msp->framing == MSP_FRAMING_V0)
+        len = min(len, UINT8_MAX);
+
+    return msp_frame_size(sub->msp, sub->cmd, len);
+}
+
+/*
+ * Move to a new @grant. A running subscription keeps its phase:
+ * the next poll comes one new period after the last one, or now
+ * if that has passed already.
+ */
+static void
+msp_sub_schedule(struct msp_sub *sub, double grant,
+                 const struct timeval *now)
+{
+    struct timeval last;
+
+    if (grant == sub->grant)
+        return;
+
+    if (grant <= 0) {
+        sub->grant = grant;
+        timer_stop(sub->timer);
+        return;
+    }
+
+    if (sub->grant > 0)
+        timersub(&sub->next, &sub->period, &last);
+    else
+        last = *now;
+
+    sub->grant = grant;
+    sub->period = sec2tv(1 / grant);
+
+    timeradd(&last, &sub->period, &sub->next);
+    if (timercmp(&sub->next, now, <))
+        sub->next = *now;
+
+    evtloop_add_timer(sub->msp->loop, sub->timer, &sub->next);
+}
+
+/*
+ * Hand out link bandwidth by priority level. Each level gets
+ * what it asks for if it fits in what is left, else all levels
+ * below it get nothing and the level is scaled to fit. Tx and rx
+ * are separate wires, the tighter one determines the scale.
+ */
+static void
+msp_sub_rebalance(struct msp *msp)
+{
+    struct msp_sub *sub, *lvl;
+    struct timeval now;
+    double tx, rx;
+    int baud;
+
+    baud = tty_baud(msp->tty);
+
+    tx = rx = baud / 10.0 * MSP_SUB_BUDGET / 100;
+
+    gettimeofday(&now, NULL);
+
+    lvl = list_first_entry(&msp->subs, struct msp_sub, entry);
+
+    while (lvl) {
+        double ltx, lrx, scale;
+
+        ltx = lrx = 0;
+        sub = lvl;
+        do {
+            ltx += sub->hz * msp_frame_size(msp, sub->cmd, 0);
+            lrx += sub->hz * msp_sub_rsp_size(sub);
+
+            sub = list_next_entry(&msp->subs, sub, entry);
+        } while (sub && sub->prio == lvl->prio);
+
+        scale = 1;
+        if (baud > 0) {
+            if (ltx > tx)
+                scale = min(scale, tx / ltx);
+            if (lrx > rx)
+                scale = min(scale, rx / lrx);
+
+            scale = max(scale, 0);
+
+            tx -= ltx * scale;
+            rx -= lrx * scale;
+        }
+
+        sub = lvl;
+        do {
+            msp_sub_schedule(sub, sub->hz * scale, &now);
+
+            sub = list_next_entry(&msp->subs, sub, entry);
+        } while (sub && sub->prio == lvl->prio);
+
+        lvl = sub;
+    }
+}
+
+static long
+msp_sub_field_get(const struct msp_sub_field *f, const uint8_t *p)
+{
+    uint8_t u8;
+    uint16_t u16;
+    uint32_t u32;
+
+    switch (f->size) {
+    case 1:
+        memcpy(&u8, p + f->off, 1);
+        return f->sign ? (long)(int8_t)u8 : (long)u8;
+    case 2:
+        memcpy(&u16, p + f->off, 2);
+        return f->sign ? (long)(int16_t)u16 : (long)u16;
+    default:
+        memcpy(&u32, p + f->off, 4);
+        return f->sign ? (long)(int32_t)u32 : (long)u32;
+    }
+}
+
+/*
+ * Whether @data differs from the response last delivered, by
+ * more than the deadbands.
+ */
+static int
+msp_sub_changed(const struct msp_sub *sub,
+                const struct msp_hdr *hdr, const void *data)
+{
+    int i;
+
+    if (!sub->have || hdr->len != sub->prevlen)
+        return 1;
+
+    if (!sub->nfields)
+        return memcmp(data, sub->prev, hdr->len) != 0;
+
+    for (i = 0; i < sub->nfields; i++) {
+        const struct msp_sub_field *f = &sub->fields[i];
+        long d;
+
+        if (f->off + f->size > hdr->len)
+            continue;
+
+        d = msp_sub_field_get(f, data) - msp_sub_field_get(f, sub->prev);
+        if ((unsigned long)labs(d) > f->deadband)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * In delta mode, whether to deliver this response. Remembers it
+ * if so.
+ */
+static int
+msp_sub_deliver(struct msp_sub *sub, const struct msp_hdr *hdr,
+                const void *data, const struct timeval *now)
+{
+    struct timeval end;
+
+    if (!msp_sub_changed(sub, hdr, data)) {
+        if (!timerisset(&sub->heartbeat))
+            return 0;
+
+        timeradd(&sub->delivered, &sub->heartbeat, &end);
+        if (timercmp(now, &end, <))
+            return 0;
+    }
+
+    if (hdr->len)
+        memcpy(sub->prev, data, hdr->len);
+    sub->prevlen = hdr->len;
+    sub->have = 1;
+    sub->delivered = *now;
+
+    return 1;
+}
+
+static void
+msp_sub_retfn(int err,
+              const struct msp_hdr *hdr, void *data, void *priv)
+{
+    struct msp_sub *sub = priv;
+    struct timeval now, end;
+
+    sub->busy = 0;
+    sub->call = NULL;
+
+    if (err)
+        sub->errors++;
+    else
+        sub->cnt++;
+
+    gettimeofday(&now, NULL);
+    timeradd(&sub->since, &MSP_SUB_RATE_WINDOW, &end);
+
+    if (!timercmp(&now, &end, <)) {
+        struct timeval dt;
+
+        timersub(&now, &sub->since, &dt);
+
+        sub->rate = sub->cnt / tv2sec(&dt);
+        sub->cnt = 0;
+        sub->since = now;
+    }
+
+    if (sub->delta && !err && !msp_sub_deliver(sub, hdr, data, &now)) {
+        sub->dropped++;
+        if (data)
+            free(data);
+        return;
+    }
+
+    sub->fn(err, hdr, data, sub->priv);
+}
+
+static void
+msp_sub_tick(const struct timeval *timeo, void *data)
+{
+    struct msp_sub *sub = data;
+    struct msp *msp = sub->msp;
+    struct timeval now;
+    struct msp_call *call;
+    struct msp_req req;
+    int rc;
+
+    gettimeofday(&now, NULL);
+
+    timeradd(timeo, &sub->period, &sub->next);
+    if (timercmp(&sub->next, &now, <))
+        timeradd(&now, &sub->period, &sub->next);
+
+    evtloop_add_timer(msp->loop, sub->timer, &sub->next);
+
+    if (sub->busy) {
+        sub->missed++;
+        return;
+    }
+
+    req = (struct msp_req) {
+        .cmd = sub->cmd,
+        .rfn = msp_sub_retfn,
+        .priv = sub,
+    };
+
+    /* the call may complete before submit returns */
+    sub->busy = 1;
+
+    rc = msp_call_submit(msp, &req, NULL, &call);
+    if (rc) {
+        sub->busy = 0;
+        sub->missed++;
+        return;
+    }
+
+    if (sub->busy)
+        sub->call = call;
+}
+
+static void
+msp_sub_insert(struct msp *msp, struct msp_sub *sub)
+{
+    struct msp_sub *next;
+
+    list_for_each_entry(&msp->subs, next, entry)
+        if (next->prio < sub->prio) {
+            list_insert_before(&next->entry, &sub->entry);
+            return;
+        }
+
+    list_insert_tail(&msp->subs, &sub->entry);
+}
+
+struct msp_sub *
+msp_subscribe(struct msp *msp, msp_cmd_t cmd, unsigned int hz,
+              msp_call_retfn fn, void *priv)
+{
+    struct msp_sub *sub;
+    int rc;
+
+    rc = -1;
+    sub = NULL;
+
+    if (cmd < MSP_CMD_MIN || !hz) {
+        errno = EINVAL;
+        goto out;
+    }
+
+    sub = calloc(1, sizeof(*sub));
+    if (!expected(sub))
+        goto out;
+
+    sub->entry = LIST(&sub->entry);
+    sub->msp = msp;
+    sub->cmd = cmd;
+    sub->hz = hz;
+    sub->fn = fn;
+    sub->priv = priv;
+
+    sub->timer = __timer_create(msp_sub_tick, sub);
+    if (!expected(sub->timer))
+        goto out;
+
+    gettimeofday(&sub->since, NULL);
+
+    msp_sub_insert(msp, sub);
+    msp_sub_rebalance(msp);
+
+    rc = 0;
+out:
+    if (rc && sub) {
+        int err = errno;
+
+        msp_unsubscribe(sub);
+        sub = NULL;
+
+        errno = err;
+    }
+
+    return sub;
+}
+
+void
+msp_unsubscribe(struct msp_sub *sub)
+{
+    struct msp *msp = sub->msp;
+
+    if (sub->call)
+        msp_call_orphan(sub->call);
+
+    if (sub->timer)
+        timer_destroy(sub->timer);
+
+    if (sub->fields)
+        free(sub->fields);
+
+    list_remove(&sub->entry);
+    free(sub);
+
+    msp_sub_rebalance(msp);
+}
+
+void
+msp_sub_set_prio(struct msp_sub *sub, int prio)
+{
+    struct msp *msp = sub->msp;
+
+    list_remove(&sub->entry);
+    sub->prio = prio;
+    msp_sub_insert(msp, sub);
+
+    msp_sub_rebalance(msp);
+}
+
+int
+msp_sub_set_delta(struct msp_sub *sub,
+                  const struct msp_sub_field *fields, int nfields,
+                  const struct timeval *heartbeat)
+{
+    struct msp_sub_field *copy;
+    int i;
+
+    if (nfields < 0 || (nfields && !fields))
+        goto inval;
+
+    for (i = 0; i < nfields; i++) {
+        const struct msp_sub_field *f = &fields[i];
+
+        if (f->size != 1 && f->size != 2 && f->size != 4)
+            goto inval;
+
+        if (f->off + f->size > MSP_LEN_MAX)
+            goto inval;
+    }
+
+    copy = NULL;
+    if (nfields) {
+        copy = malloc(nfields * sizeof(*copy));
+        if (!expected(copy))
+            return -1;
+
+        memcpy(copy, fields, nfields * sizeof(*copy));
+    }
+
+    msp_sub_clear_delta(sub);
+
+    sub->delta = 1;
+    sub->fields = copy;
+    sub->nfields = nfields;
+    if (heartbeat)
+        sub->heartbeat = *heartbeat;
+
+    return 0;
+
+inval:
+    errno = EINVAL;
+    return -1;
+}
+
+void
+msp_sub_clear_delta(struct msp_sub *sub)
+{
+    if (sub->fields)
+        free(sub->fields);
+
+    sub->delta = 0;
+    sub->fields = NULL;
+    sub->nfields = 0;
+    timerclear(&sub->heartbeat);
+    sub->have = 0;
+}
+
+void
+msp_sub_stat(const struct msp_sub *sub, struct msp_sub_stat *st)
+{
+    *st = (struct msp_sub_stat) {
+        .hz = sub->hz,
+        .grant = sub->grant,
+        .rate = sub->rate,
+        .missed = sub->missed,
+        .errors = sub->errors,
+        .dropped = sub->dropped,
+    };
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,80 @@
+#ifndef MSP_SUB_H
+#define MSP_SUB_H
+
+#include <msp/msp.h>
+
+#include <stddef.h>
+
+/*
+ * Periodic polling of a command at @hz. The library schedules
+ * the requests and passes each response to @fn like any other
+ * msp_call completion.
+ *
+ * Subscriptions share the link: each poll costs the request and
+ * max response frame time at the tty baud rate. When the sum
+ * exceeds the link budget, rates are scaled down. Higher
+ * priority subscriptions are served first, those of equal
+ * priority are scaled proportionally.
+ */
+struct msp_sub *msp_subscribe(struct msp *msp, msp_cmd_t cmd,
+                              unsigned int hz,
+                              msp_call_retfn fn, void *priv);
+
+void msp_unsubscribe(struct msp_sub *sub);
+
+void msp_sub_set_prio(struct msp_sub *sub, int prio);
+
+/*
+ * A field of the decoded response, 1, 2 or 4 bytes wide, which
+ * only counts as changed once it moved more than @deadband away
+ * from the value last delivered.
+ */
+struct msp_sub_field {
+    size_t off;
+    size_t size;
+    int sign;
+    unsigned long deadband;
+};
+
+#define MSP_SUB_FIELD(_type, _memb, _deadband)                  \
+    (struct msp_sub_field) {                                    \
+        .off = offsetof(_type, _memb),                          \
+        .size = sizeof(((_type *)0)->_memb),                    \
+        .sign = (typeof(((_type *)0)->_memb))-1 < 0,            \
+        .deadband = (_deadband),                                \
+    }
+
+/*
+ * Change-only delivery. Responses reach @fn only when they differ
+ * from the last one delivered, or @heartbeat passed since; a NULL
+ * @heartbeat means never. Without @fields, any byte counts, else
+ * only the fields listed. Errors are always delivered.
+ */
+int msp_sub_set_delta(struct msp_sub *sub,
+                      const struct msp_sub_field *fields, int nfields,
+                      const struct timeval *heartbeat);
+
+void msp_sub_clear_delta(struct msp_sub *sub);
+
+struct msp_sub_stat {
+    unsigned int hz;        /* requested rate */
+    double grant;           /* scheduled rate, within link budget */
+    double rate;            /* achieved rate, responses/s */
+    unsigned long missed;   /* ticks skipped, poll still pending */
+    unsigned long errors;   /* failed polls */
+    unsigned long dropped;  /* responses unchanged, not delivered */
+};
+
+void msp_sub_stat(const struct msp_sub *sub, struct msp_sub_stat *st);
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */